@@ -0,0 +1,550 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <time.h>
+#include <termios.h>
+#include "hal.h"
+#include "han.h"
+#include "hancrc.h"
+
+/*
+ * Single node simulator front end
+ *
+ * Boots batterymon.c on the simulated PIC (sim.c), then runs every command
+ * in the benchmark table against it and reports, per command, the modeled
+ * turnaround (last request byte in to first response byte out), the full
+ * exchange time, interrupt and foreground work per exchange, and the host
+ * time spent in the firmware.
+ *
+ * With -p the node is instead attached to a pseudo terminal, whose slave
+ * path is printed, and simulated time is paced to the wall clock so a real
+ * master (hanbench.c) can be run against it.
+ *
+ * With -b the node is first switched to another rate with GBAU. An
+ * unconfirmed switch is tried first, to check the node falls back.
+ *
+ * With -H the node first logs a history record a second for that many
+ * seconds, so GHIS (plain) and GHPK (GHIS, packed) read back full pages.
+ *
+ * With -I the node is polled with GVIP every 10 mSec at each rate, and the
+ * core duty cycle (time not in SLEEP), SLEEP's a second, the longest a
+ * received byte waited to be read and any overruns are reported. The
+ * longest wait should stay under a byte time. The core only sleeps when
+ * built with -DIDLE_SLEEP (see hal.h).
+ *
+ * With -D the node's own latency diagnostics (GDIA) are read and printed
+ * after the run.
+ *
+ * With -O the node is instead held, interrupts off, while a request
+ * arrives, so its receiver overruns, then sent a request 10% fast. It
+ * should answer after each, and the GCSX counters are printed.
+ *
+ * Build: cc -O2 -DSIMULATOR -o batsim batsim.c sim.c batterymon.c
+ * Usage: batsim [-n iterations] [-8] [-p] [-b rate] [-v volts] [-a amps]
+ *        [-H seconds] [-I] [-D] [-O]
+ *        rate: 0 9600, 1 38400, 2 115200, 3 250000
+ */
+
+#define NODEADDR	0x1F			// Address of a node with erased EEPROM
+#define TIMEOUT_MS	300
+#define DEF_AMPS	200			// Default shunt of an erased node
+#define DEF_MV		50
+
+typedef struct {
+	const char *name;
+	uint8_t cmd;
+	uint8_t plen;
+	uint8_t params[MAXXPARAMS];
+	uint8_t flags;				// Header flags, HDCPK for a packed reply
+	uint8_t addr;				// Address, 0 for the node
+} op_t;
+
+static const op_t ops[] = {
+	{.name = "NOOP", .cmd = NOOP},
+	{.name = "GNID", .cmd = GNID, .plen = 4},
+	{.name = "GCST", .cmd = GCST, .plen = 3},
+	{.name = "GOUT", .cmd = GOUT, .plen = 3, .params = {0, 2, 0}},
+	{.name = "GVLT", .cmd = GVLT, .plen = 8},
+	{.name = "GCUR", .cmd = GCUR, .plen = 8},
+	{.name = "GPWR", .cmd = GPWR, .plen = 8},
+	{.name = "GVIP", .cmd = GVIP, .plen = 12},
+	{.name = "GSCF", .cmd = GSCF, .plen = 4},
+	{.name = "GSCW", .cmd = GSCF, .plen = 4,
+	.params = {1, DEF_MV, DEF_AMPS, 0}}, // Write, same shunt
+	{.name = "GBAU", .cmd = GBAU, .plen = 2},
+	{.name = "GACC", .cmd = GACC, .plen = 11, .params = {1, 0}},
+	{.name = "GSTA", .cmd = GSTA, .plen = 10, .params = {0, 1}},
+	{.name = "GALM", .cmd = GALM, .plen = 5},
+	{.name = "GHIS", .cmd = GHIS, .plen = 4, .params = {0, 0, 0, 9}},
+	{.name = "GHPK", .cmd = GHIS, .plen = 4, .params = {0, 0, 0, 32},
+	.flags = HDCPK},
+	{.name = "GSNP", .cmd = GSNP, .plen = 13, .params = {1, 0x5A}},
+	{.name = "GSLT", .cmd = GSLT, .plen = 4, .params = {0x5A, NODEADDR - 2, 8, 0},
+	.addr = 0xFF}, // Third slot
+	{.name = "GADC", .cmd = GADC, .plen = 4},
+	{.name = "GDIA", .cmd = GDIA, .plen = 26, .flags = HDCX},
+	{.name = "GCSX", .cmd = GCSX, .plen = 25, .flags = HDCX},
+	{.name = "GBAT", .cmd = GBAT, .plen = 24, .params = {GCST, 3, 0, 0, 0, GVIP,
+	12, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, GOUT, 3, 0, 1, 0}, .flags = HDCX},
+	// Status, V/I/P and set OD1
+};
+
+static const unsigned bauds[] = {9600, 38400, 115200, 250000};
+
+static const op_t gipl = {.name = "GIPL", .cmd = GIPL, .plen = 1};
+static const op_t gvip = {.name = "GVIP", .cmd = GVIP, .plen = 12};
+
+/* Response deframer */
+static struct {
+	uint8_t buf[MAXXPACKET + 1];
+	unsigned len;
+	int inframe, sub, done;
+} resp;
+
+static unsigned irqframes;			// IRQ frames seen
+
+static void txhook(uint8_t c)
+{
+	if(resp.done)
+		return;
+	if(!resp.sub){
+		if(STX == c){
+			resp.inframe = 1;
+			resp.len = 0;
+			return;
+		}
+		if(ETX == c){
+			if(resp.inframe && resp.len &&
+			(HDCIRQ == resp.buf[0] || HDCIRQ16 == resp.buf[0]))
+				irqframes++; // Not a response, keep waiting
+			else if(resp.inframe)
+				resp.done = 1;
+			resp.inframe = 0;
+			return;
+		}
+		if(SUBST == c){
+			resp.sub = 1;
+			return;
+		}
+	}
+	resp.sub = 0;
+	if(resp.inframe && resp.len < sizeof(resp.buf))
+		resp.buf[resp.len++] = c;
+}
+
+/*
+ * Build a stuffed frame, return its length
+ */
+
+static unsigned build_frame(uint8_t *out, int crc16, uint8_t addr,
+const op_t *op)
+{
+	uint8_t raw[MAXXPACKET + 2];
+	unsigned n = 0, i, o = 0;
+	uint16_t crc = 0;
+
+	raw[n++] = (crc16 ? HDC16 : HDC) | op->flags;
+	raw[n++] = addr;
+	raw[n++] = op->cmd;
+	memcpy(raw + n, op->params, op->plen);
+	n += op->plen;
+	for(i = 0; i < n; i++)
+		crc = crc16 ? crc16_update(crc, raw[i]) :
+		crc8_update((uint8_t) crc, raw[i]);
+	raw[n++] = (uint8_t) crc;
+	if(crc16)
+		raw[n++] = (uint8_t) (crc >> 8);
+
+	out[o++] = STX;
+	for(i = 0; i < n; i++){
+		if(raw[i] <= SUBST)
+			out[o++] = SUBST;
+		out[o++] = raw[i];
+	}
+	out[o++] = ETX;
+	return o;
+}
+
+/*
+ * Check a response CRC
+ */
+
+static int check_frame(int crc16)
+{
+	uint16_t crc = 0;
+	unsigned i, n;
+
+	if(resp.len < PKTCTRL + (crc16 ? 2 : 1))
+		return 0;
+	n = resp.len - (crc16 ? 2 : 1);
+	for(i = 0; i < n; i++)
+		crc = crc16 ? crc16_update(crc, resp.buf[i]) :
+		crc8_update((uint8_t) crc, resp.buf[i]);
+	if(crc16)
+		return (resp.buf[n] | (resp.buf[n + 1] << 8)) == crc;
+	return resp.buf[n] == crc;
+}
+
+/*
+ * Send a request and run the node until the response is in
+ */
+
+static int exchange(int crc16, const op_t *op)
+{
+	uint8_t frame[2 * MAXXPACKET + 2];
+	unsigned len;
+	uint64_t deadline;
+
+	len = build_frame(frame, crc16, op->addr ? op->addr : NODEADDR, op);
+	memset(&resp, 0, sizeof(resp));
+	sim_txfirst = 0;
+	deadline = sim_stats.cycles + (uint64_t) SIM_MIPS * TIMEOUT_MS / 1000;
+	sim_uart_send(frame, len);
+	while(!resp.done && sim_stats.cycles < deadline)
+		node_poll();
+	return resp.done && check_frame(crc16) &&
+	((resp.buf[0] & ~HDCFLAGS) == (crc16 ? HDC_ACK16 : HDC_ACK));
+}
+
+/*
+ * Attach the node to a pseudo terminal and run it in real time
+ */
+
+static int ptyfd;
+
+static void ptyhook(uint8_t c)
+{
+	while(write(ptyfd, &c, 1) < 0 && EAGAIN == errno)
+		usleep(100);
+}
+
+static void pty_mode(void)
+{
+	struct termios tio;
+	struct timespec start, t;
+	uint8_t buf[256];
+	uint64_t base, wall;
+	ssize_t n;
+
+	if((ptyfd = posix_openpt(O_RDWR | O_NOCTTY)) < 0 || grantpt(ptyfd) < 0 ||
+	unlockpt(ptyfd) < 0){
+		perror("pty");
+		exit(1);
+	}
+	tcgetattr(ptyfd, &tio);
+	cfmakeraw(&tio);
+	tcsetattr(ptyfd, TCSANOW, &tio);
+	fcntl(ptyfd, F_SETFL, O_NONBLOCK);
+	printf("%s\n", ptsname(ptyfd));
+	fflush(stdout);
+
+	sim_txhook = ptyhook;
+	sim_init();
+	base = sim_stats.cycles;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(;;){
+		while((n = read(ptyfd, buf, sizeof(buf))) > 0)
+			sim_uart_send(buf, (unsigned) n);
+		sim_run(SIM_MIPS / 10000); // 100 uSec
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		wall = (uint64_t) ((t.tv_sec - start.tv_sec) * 1e6 +
+		(t.tv_nsec - start.tv_nsec) / 1e3);
+		if(sim_stats.cycles - base > wall * (SIM_MIPS / 1000000))
+			usleep(100);
+	}
+}
+
+/*
+ * Switch the node and the host side to a new rate
+ */
+
+static int switch_baud(int crc16, unsigned rate, int confirm)
+{
+	op_t op = {.name = "GBAU", .cmd = GBAU, .plen = 2, .params = {0, 1}};
+
+	op.params[0] = (uint8_t) rate;
+	if(!exchange(crc16, &op))
+		return 0;
+	sim_run(SIM_MIPS / 1000);
+	sim_hostbittime = SIM_MIPS / bauds[rate];
+	if(!confirm)
+		return 1;
+	op.params[1] = 2;
+	return exchange(crc16, &op);
+}
+
+static double us(uint64_t cycles)
+{
+	return cycles * 1e6 / SIM_MIPS;
+}
+
+/*
+ * Read and print the node's latency diagnostics
+ */
+
+static unsigned word(unsigned i)
+{
+	return resp.buf[3 + i] | (resp.buf[4 + i] << 8);
+}
+
+static uint32_t dword(unsigned i)
+{
+	return word(i) | (uint32_t) word(i + 2) << 16;
+}
+
+static void print_diag(int crc16)
+{
+	static const char *const lats[] = {"turnaround", "INA226"};
+	static const char *const phases[] = {"START", "PKT_READY", "PKT_DECODE",
+	"PKT_RESP", "WAIT_SLOT", "TX_START", "WAIT_TX", "WAIT_EMPTY", "FIN"};
+	static const char *const handlers[] = {"RDA", "TMR0", "I2C", "INT", "TBE"};
+	op_t op = {.name = "GDIA", .cmd = GDIA, .plen = 26, .flags = HDCX};
+	unsigned b, i;
+
+	printf("\n%-10s %6s %6s %6s %6s   bins <32 <64 <128 ... >=2048 uSec\n",
+	"latency", "min", "max", "mean", "count");
+	for(b = 0; b < 2; b++){
+		op.params[1] = (uint8_t) b;
+		if(!exchange(crc16, &op)){
+			printf("GDIA %u failed\n", b);
+			return;
+		}
+		printf("%-10s %6u %6u %6u %6u  ", lats[b], word(2), word(4),
+		word(6), word(8));
+		for(i = 0; i < 8; i++)
+			printf(" %u", word(10 + 2 * i));
+		printf("\n");
+	}
+	op.plen = 58;
+	op.params[1] = 2;
+	if(!exchange(crc16, &op)){
+		printf("GDIA 2 failed\n");
+		return;
+	}
+	printf("isr: max %u uSec in %lu entries\n", word(2),
+	(unsigned long) dword(4));
+	for(i = 0; i < 5; i++)
+		printf("  %-4s max %4u uSec, %8lu uSec in %8lu runs\n", handlers[i],
+		word(8 + 10 * i), (unsigned long) dword(10 + 10 * i),
+		(unsigned long) dword(14 + 10 * i));
+	op.plen = 38;
+	op.params[1] = 3;
+	if(!exchange(crc16, &op)){
+		printf("GDIA 3 failed\n");
+		return;
+	}
+	printf("longest stay (uSec):");
+	for(i = 0; i < 9; i++)
+		printf(" %s %lu", phases[i], (unsigned long) dword(2 + 4 * i));
+	printf("\n");
+}
+
+/*
+ * Force an overrun and a rate mismatch and check the node recovers
+ */
+
+static void errors_mode(int crc16)
+{
+	static const char *const names[] = {"crcerrs", "timeouts", "overruns",
+	"framing", "dropped", "frames"};
+	op_t gcsx = {.name = "GCSX", .cmd = GCSX, .plen = 25, .params = {1},
+	.flags = HDCX};
+	uint8_t frame[2 * MAXXPACKET + 2];
+	unsigned len, i, bittime = sim_uart_bittime();
+
+	exchange(crc16, &gcsx); // Read and reset
+	len = build_frame(frame, crc16, NODEADDR, &gvip);
+
+	// Four bytes arrive with the core held, the FIFO holds two
+	sim_hostbittime = bittime;
+	sim_uart_send(frame, len);
+	sim_stall((uint64_t) bittime * 10 * 4);
+	sim_run((uint64_t) SIM_MIPS * TIMEOUT_MS / 1000);
+	printf("After an overrun: node %s\n", exchange(crc16, &ops[0]) ?
+	"answers" : "is deaf");
+
+	sim_hostbittime = bittime * 9 / 10;
+	sim_uart_send(frame, len);
+	sim_run((uint64_t) SIM_MIPS * TIMEOUT_MS / 1000);
+	sim_hostbittime = bittime;
+	printf("After a rate mismatch: node %s\n", exchange(crc16, &ops[0]) ?
+	"answers" : "is deaf");
+
+	gcsx.params[0] = 0;
+	if(!exchange(crc16, &gcsx)){
+		printf("GCSX failed\n");
+		exit(1);
+	}
+	for(i = 0; i < 6; i++)
+		printf("%s %lu%s", names[i], (unsigned long) (word(1 + 4 * i) |
+		(uint32_t) word(3 + 4 * i) << 16), (i < 5) ? ", " : "\n");
+	printf("Model: %lu overruns, %lu framing errors\n",
+	(unsigned long) sim_stats.overruns, (unsigned long) sim_stats.framing);
+	exit(0);
+}
+
+/*
+ * Poll the node at each rate and report how long it spends asleep
+ */
+
+static void idle_mode(int crc16, unsigned iters)
+{
+	unsigned rate, i, good;
+	uint64_t bytetime;
+	sim_stats_t s0;
+	double secs;
+
+#ifndef IDLE_SLEEP
+	printf("Built without IDLE_SLEEP, the core never sleeps\n");
+#endif
+	printf("%-7s %6s %8s %10s %10s %10s %9s\n", "baud", "ok", "duty(%)",
+	"sleeps/s", "rxlat(us)", "byte(us)", "overruns");
+	sim_init();
+	sim_run((uint64_t) SIM_MIPS * 2);
+	exchange(crc16, &gipl);
+	for(rate = 0; rate < sizeof(bauds) / sizeof(bauds[0]); rate++){
+		if(rate && !switch_baud(crc16, rate, 1)){
+			printf("Switch to %u baud failed\n", bauds[rate]);
+			continue;
+		}
+		bytetime = (uint64_t) sim_uart_bittime() * 10;
+		sim_run(SIM_MIPS / 100);
+		good = 0;
+		s0 = sim_stats;
+		sim_stats.rxlatmax = 0;
+		for(i = 0; i < iters; i++){
+			good += exchange(crc16, &gvip);
+			sim_run(SIM_MIPS / 100);
+		}
+		secs = (double) (sim_stats.cycles - s0.cycles) / SIM_MIPS;
+		printf("%-7u %6u %8.1f %10.0f %10.1f %10.1f %9lu\n", bauds[rate],
+		good, 100.0 * (1 - (double) (sim_stats.idlecycles - s0.idlecycles) /
+		(sim_stats.cycles - s0.cycles)),
+		(sim_stats.sleeps - s0.sleeps) / secs, us(sim_stats.rxlatmax),
+		us(bytetime), (unsigned long) (sim_stats.overruns - s0.overruns));
+	}
+	exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned iters = 100, i, k, good;
+	int opt, crc16 = 1, pty = 0, rate = -1, fill = 0, idle = 0, diag = 0;
+	int errors = 0;
+	uint64_t start, turn, exch;
+	sim_stats_t s0;
+
+	sim_ina226.volts = 13.2;
+	sim_ina226.amps = 12.5;
+
+	while((opt = getopt(argc, argv, "n:8pb:v:a:H:IDO")) != -1){
+		switch(opt){
+			case 'n':
+				iters = atoi(optarg);
+				break;
+			case '8':
+				crc16 = 0;
+				break;
+			case 'p':
+				pty = 1;
+				break;
+			case 'b':
+				rate = atoi(optarg);
+				break;
+			case 'v':
+				sim_ina226.volts = atof(optarg);
+				break;
+			case 'a':
+				sim_ina226.amps = atof(optarg);
+				break;
+			case 'H':
+				fill = atoi(optarg);
+				break;
+			case 'I':
+				idle = 1;
+				break;
+			case 'D':
+				diag = 1;
+				break;
+			case 'O':
+				errors = 1;
+				break;
+			default:
+				printf("Usage: batsim [-n iterations] [-8] [-p] [-b rate] [-v volts] [-a amps] [-H seconds] [-I] [-D] [-O]\n");
+				exit(1);
+		}
+	}
+
+	if(pty)
+		pty_mode();
+	sim_txhook = txhook;
+	if(idle)
+		idle_mode(crc16, iters);
+	sim_init();
+	sim_run((uint64_t) SIM_MIPS * 2); // Let the boot IRQ go out
+	exchange(crc16, &gipl); // and acknowledge it
+
+	if(rate > 0 && rate < (int) (sizeof(bauds) / sizeof(bauds[0]))){
+		// Unconfirmed, the node should be back at 9600 after 3 seconds
+		switch_baud(crc16, rate, 0);
+		sim_run((uint64_t) SIM_MIPS * 4);
+		sim_hostbittime = SIM_MIPS / bauds[0];
+		printf("Unconfirmed switch: node %s\n", exchange(crc16, &ops[0]) ?
+		"reverted" : "did not revert");
+		if(!switch_baud(crc16, rate, 1)){
+			printf("Switch to %u baud failed\n", bauds[rate]);
+			exit(1);
+		}
+	}
+
+	if(errors)
+		errors_mode(crc16);
+
+	if(fill > 0){
+		op_t op = {.name = "GHIS", .cmd = GHIS, .plen = 3,
+		.params = {1, 1, 0}};
+
+		// One record a second, in RAM only
+		if(!exchange(crc16, &op)){
+			printf("Set history period failed\n");
+			exit(1);
+		}
+		sim_run((uint64_t) SIM_MIPS * fill);
+	}
+
+	printf("Baud %lu, %s CRC, %u exchanges per command\n",
+	SIM_MIPS / (sim_uart_bittime()), crc16 ? "16 bit" : "8 bit", iters);
+	printf("%-5s %6s %10s %10s %8s %8s %9s %9s\n", "cmd", "ok",
+	"turn(us)", "exch(ms)", "isr/op", "fg/op", "isrns/op", "fgns/op");
+
+	for(k = 0; k < sizeof(ops) / sizeof(ops[0]); k++){
+		turn = exch = 0;
+		good = 0;
+		s0 = sim_stats;
+		for(i = 0; i < iters; i++){
+			start = sim_stats.cycles;
+			if(!exchange(crc16, &ops[k]))
+				continue;
+			good++;
+			turn += sim_txfirst - sim_rxlast;
+			exch += sim_stats.cycles - start;
+			sim_run(SIM_MIPS / 1000); // Bus turnaround gap
+		}
+		if(!good)
+			good = 1;
+		printf("%-5s %6u %10.1f %10.3f %8.1f %8.1f %9.0f %9.0f\n",
+		ops[k].name, good, us(turn / good), us(exch / good) / 1000,
+		(double) (sim_stats.isrcalls - s0.isrcalls) / iters,
+		(double) (sim_stats.fgpasses - s0.fgpasses) / iters,
+		(double) (sim_stats.isrns - s0.isrns) / iters,
+		(double) (sim_stats.fgns - s0.fgns) / iters);
+	}
+	if(diag)
+		print_diag(crc16);
+	exit(0);
+}
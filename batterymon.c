@@ -26,9 +26,11 @@
  */
 
 
-#include <xc.h>
+#include "hal.h"
 #include <stdint.h>
 #include "han.h"
+#include "hancrc.h"
+#include "inacal.h"
 
 __CONFIG(WDTE_OFF & LVP_OFF & FOSC_INTOSC & 
         PWRTE_ON & CP_OFF & CPD_OFF & BOREN_ON & CLKOUTEN_OFF &
@@ -68,7 +70,9 @@ __CONFIG(WRT_ALL & VCOREV_OFF & PLLEN_ON & STVREN_ON &
 
 /* EEPROM */
 #define EECONFIGSTART   0x00
-#define EESIG           0x55AA
+#define EESIG           0x55AB  /* Config block with the node settings */
+#define EESIG_V1        0x55AA  /* Original block, shunt and rate only */
+#define EEV1_LEN        6       /* Bytes of the original block in use */
 #define DEF_SHUNT_AMPS  200
 #define DEF_SHUNT_MV    50
 
@@ -82,10 +86,24 @@ __CONFIG(WRT_ALL & VCOREV_OFF & PLLEN_ON & STVREN_ON &
 #define INA226_POWER    0x03
 #define INA226_CURRENT  0x04
 #define INA226_CAL      0x05
+#define INA226_MASK     0x06
+#define INA226_ALERTLIM 0x07
+
+/* INA226 Mask/Enable bits */
+#define INA226_CVRF     0x0008  /* Conversion ready */
+#define INA226_BUL      0x1000  /* Bus under voltage alert */
 
 /* INA226 Initial Constants */
 #define INA226_INIT_CONFIG 0x0927
 
+/* INA226 configuration fields, set with GADC */
+#define INA226_AVG_SHIFT    9
+#define INA226_VBUSCT_SHIFT 6
+#define INA226_VSHCT_SHIFT  3
+#define INA226_FIELD        0x07
+#define INA226_MODE_CONT    0x0007  /* Shunt and bus, continuous */
+#define INA226_MIN_CONV     4000    /* uSec, shortest profile GADC accepts */
+
 /* Misc constants */
 #define VOLTRES 1250       // Microvolt per bit
 #define VMAG -6
@@ -94,20 +112,48 @@ __CONFIG(WRT_ALL & VCOREV_OFF & PLLEN_ON & STVREN_ON &
 
 /* Macros */
 
-#define SET_BAUD(B) (((_XTAL_FREQ/B)/64) - 1)
+#define SET_BAUD(B) (((_XTAL_FREQ/(B))/4) - 1) // BRG16 = 1, BRGH = 1
 
 #define INA226_TRANS_START(RP, RW, REG )\
-{i2c.rw = RW; i2c.regptr = RP; i2c.reg = REG; i2c.busy = TRUE; SSP1CON2bits.SEN = TRUE;}
+{i2c.rw = RW; i2c.regptr = RP; i2c.reg = REG; i2c.busy = TRUE;\
+TMR1_READ(diag.i2cstamp); SSP1CON2bits.SEN = TRUE;}
 
 #define INA226_TRANS_BUSY (i2c.busy)
 
-#define INA226_TRANS_WAIT(RP, RW, REG) {INA226_TRANS_START(RP, RW, REG);\
-while(INA226_TRANS_BUSY) CLRWDT();}
+/* Foreground transaction, holds off the background sampler while it runs */
+#define INA226_TRANS_WAIT(RP, RW, REG) {sampler.hold = TRUE;\
+while(INA226_TRANS_BUSY) CLRWDT();\
+INA226_TRANS_START(RP, RW, REG);\
+while(INA226_TRANS_BUSY) CLRWDT();\
+sampler.hold = FALSE;}
 
 #define INA226_RESULT i2c.reg
 
 #define ADDRPROGMODE (ADDRPROG == 1) // Jumper removed
 
+/* Foreground events, posted by the ISRs and tasks, taken by node_poll().
+   A bit per event, so posting is one instruction and safe anywhere */
+#define EV_RX       0x01    /* Byte in the receive ring */
+#define EV_TXDONE   0x02    /* Last byte of a frame handed to the EUSART */
+#define EV_TICK     0x04    /* 1.024 mSec tick */
+#define EV_PKT      0x08    /* Packet handler has more to do */
+#define EV_ALARM    0x10    /* Alarm pending and no IRQ outstanding */
+#define EV_HIST     0x20    /* History record due */
+#define EV_FOLD     0x40    /* Accumulators due to be folded */
+#define EV_EESAVE   0x80    /* Config block or history record to save */
+
+#define POST(EV) (events |= (EV))
+
+/* Free running Timer1, 1 uSec. TMR1H is read either side of TMR1L in case
+   TMR1L carries between the two reads */
+#define TMR1_READ(T) {uint8_t h_; do{h_ = TMR1H; (T) = TMR1L;} while(h_ != TMR1H);\
+(T) |= (uint16_t) h_ << 8;}
+
+/* uSec from a Timer1 stamp and the irq.prescale tick taken with it,
+   saturating before Timer1 wraps */
+#define DIAG_SINCE(NOW, T0, TICK0) (((uint8_t) (irq.prescale - (TICK0)) >= 63) ?\
+0xFFFF : (uint16_t) ((NOW) - (T0)))
+
 
 
 /*
@@ -139,17 +185,259 @@ typedef struct {
     }priv;
 }i2c_t;
 
+/* INA226 register snapshot */
+
+typedef struct {
+    uint16_t bus;
+    uint16_t current;
+    uint16_t power;
+} ina226snap_t;
+
+/* Background INA226 sampler control block */
+
+typedef struct {
+    struct {
+        unsigned run : 1;       /* Sampler enabled */
+        unsigned active : 1;    /* Sampler owns the I2C transaction */
+        unsigned hold : 1;      /* Foreground wants the bus */
+        unsigned valid : 1;     /* A snapshot has been published */
+    };
+    uint8_t reg;                /* Index into sampler_regs */
+    uint8_t wr;                 /* Snapshot being filled */
+    uint8_t seq;                /* Bumped on every publish */
+    ina226snap_t snap[2];       /* Double buffered snapshot */
+}sampler_t;
+
+/* Snapshot latched by GSNP, usually broadcast so every node latches at once */
+
+typedef struct {
+    ina226snap_t snap;
+    uint8_t tag;                /* Chosen by the master, names the trigger */
+    struct {
+        unsigned valid : 1;     /* A snapshot has been latched */
+    };
+}latch_t;
+
+/* Receive byte ring. Single producer (handle_rda), single consumer (deframe) */
+
+#define RXRINGSIZE  32  /* Must be a power of 2 */
+
+typedef struct {
+    uint8_t head;               /* Written by the ISR only */
+    uint8_t tail;               /* Written by the foreground only */
+    uint8_t buf[RXRINGSIZE];
+    struct {
+        unsigned dropping : 1;  /* Last byte was dropped, ring full */
+    };
+}rxring_t;
+
+/* Communication counters, read by GCSX. They do not wrap in practice */
+
+typedef struct {
+    uint32_t crcerrs;           /* Frames failing the CRC */
+    uint32_t timeouts;          /* Frames not finished in the packet time */
+    uint32_t overruns;          /* EUSART overruns, the receiver was restarted */
+    uint32_t framing;           /* Bytes with a framing error, discarded */
+    uint32_t dropped;           /* Runs of bytes dropped with the ring full */
+    uint32_t frames;            /* Frames received intact, for any node */
+}comms_t;
+
+/* Received frame buffer */
+
+typedef struct {
+    xpkt_t pkt;
+    uint8_t len;                /* Frame length excluding STX/ETX */
+    uint16_t crc;               /* CRC folded in while deframing */
+    struct {
+        unsigned ready : 1;     /* Complete frame waiting for service */
+    };
+}frame_t;
+
+/* Up time clock */
+
+#define TICKS_SEC       977     /* 1.024 mSec ticks per second */
+
+typedef struct {
+    uint16_t ms;                /* Ticks into the second */
+    uint32_t secs;              /* Seconds since power up */
+}uptime_t;
+
+/* Sample history. Records are numbered with a 16 bit sequence number, the
+   host reads them in pages starting from a cursor */
+
+#define HIST_RECORDS    32      /* RAM ring, must be a power of 2 */
+#define HIST_SPILL      0x8000  /* Period flag, spill evicted records to EEPROM */
+#define HIST_RECLEN     6       /* Bytes per record in a page */
+#define HIST_PAGEHDR    8       /* (action, first[2], count, next[2], now[2]) */
+#define HIST_PAGEMAX    ((MAXXPARAMS - 2 - HIST_PAGEHDR) / HIST_RECLEN)
+#define HIST_PKRECMAX   9       /* Worst case packed record, 3 varints of 3 */
+#define PK_LAST         123     /* Values carried by a final varint byte */
+#define EEHISTSTART     0x18    /* Spare EEPROM after the config block */
+#define EEHISTRECORDS   28      /* 8 byte records, seq + record */
+
+typedef struct {
+    uint16_t time;              /* Up time in seconds, low 16 bits */
+    uint16_t bus;               /* Bus voltage register */
+    uint16_t current;           /* Current register */
+}histrec_t;
+
+typedef struct {
+    uint16_t seq;               /* Sequence number of the record */
+    histrec_t rec;
+}eehistrec_t;
+
+typedef struct {
+    histrec_t ring[HIST_RECORDS];
+    uint16_t seq;               /* Sequence number of the next record */
+    uint16_t held;              /* Records held in RAM and EEPROM */
+    uint16_t period;            /* Seconds between records, 0 = off */
+    uint16_t count;             /* Seconds into the period */
+    struct {
+        unsigned due : 1;       /* Record wanted, set by handle_timer0() */
+        unsigned spill : 1;     /* Spill evicted records to EEPROM */
+    };
+}hist_t;
+
+/* Min/max/mean statistics */
+
+#define STAT_QUANTITIES 3       /* Bus voltage, current, power */
+#define STAT_BIAS       0x8000  /* Makes current compare unsigned */
+
+typedef struct {
+    uint16_t min;
+    uint16_t max;
+    uint32_t sum;
+    uint16_t count;             /* Saturates at 0xFFFF, sum with it */
+}stat_t;
+
+typedef struct {
+    stat_t live[STAT_QUANTITIES];   /* Window in progress */
+    stat_t last[STAT_QUANTITIES];   /* Last completed window */
+    uint16_t window;            /* Window in seconds, 0 = until reset */
+    uint16_t secs;              /* Seconds into the window */
+    struct {
+        unsigned expired : 1;   /* Window over, roll on the next sample */
+    };
+}stats_t;
+
+/* Latency diagnostics, read by GDIA */
+
+#define DIAG_BINS       8       /* Bin n counts times under 32 << n uSec, the last the rest */
+#define DIAG_TURN       0       /* GDIA blocks */
+#define DIAG_I2C        1
+#define DIAG_ISR        2
+#define DIAG_PHASE      3
+#define DIAG_LATLEN     26      /* GDIA parameter lengths */
+#define DIAG_ISRLEN     58
+#define DIAG_PHASELEN   (2 + 4 * PHD_STATES)
+#define DIAG_RDA        0       /* isr() handlers, in the order served */
+#define DIAG_TMR0       1
+#define DIAG_I2CH       2
+#define DIAG_INT        3
+#define DIAG_TBE        4
+#define DIAG_HANDLERS   5
+
+typedef struct {
+    stat_t stat;                /* Min/max/mean in uSec */
+    uint16_t bins[DIAG_BINS];   /* Saturate at 0xFFFF */
+}lat_t;
+
+typedef struct {
+    uint32_t sum;               /* uSec */
+    uint32_t count;             /* Runs */
+    uint16_t max;
+}isrh_t;
+
+typedef struct {
+    lat_t turn;                 /* Last request byte in to first reply byte out */
+    lat_t i2c;                  /* INA226 transaction, start to stop */
+    isrh_t hnd[DIAG_HANDLERS];  /* Time in each isr() handler */
+    uint32_t isrcount;          /* isr() entries */
+    uint16_t isrmax;            /* Longest isr() entry */
+    uint32_t phase[PHD_STATES]; /* Longest stay in each packet handler state */
+    uint16_t rxstamp;           /* Timer1 at the last ETX received */
+    uint8_t rxtick;             /* irq.prescale at the same time */
+    uint16_t i2cstamp;          /* Timer1 at the transaction start */
+    uint16_t phstamp;           /* Timer1 when phd.state last changed */
+    uint16_t phticks;           /* Ticks since, saturating */
+    uint8_t phstate;            /* phd.state on the last pass */
+}diag_t;
+
+/* Alarms. Under voltage is detected by the INA226 and signalled on ALERT,
+   over current and over power are checked against each snapshot */
+
+#define ALARMS          3
+#define ALARM_UV        0x01
+#define ALARM_OC        0x02
+#define ALARM_OP        0x04
+
+typedef struct {
+    uint16_t limit[ALARMS];     /* Under voltage, over current, over power */
+    uint8_t active;             /* Software alarms over the limit */
+    uint8_t pending;            /* Alarms waiting to be raised */
+}alarm_t;
+
+/* Charge and energy accumulators */
+
+#define ACC_FOLD        1024    /* Ticks between folds into the 64 bit sums */
+#define ACC_LATCH       0x01    /* GACC action bits */
+#define ACC_RESET       0x02
+
+typedef struct {
+    uint32_t lo;
+    uint32_t hi;
+}acc64_t;                       /* Two's complement, no 64 bit int in XC8 */
+
+typedef struct {
+    int32_t isum;               /* Raw current register sum */
+    uint32_t psum;              /* Raw power register sum */
+    uint16_t n;                 /* Ticks summed */
+}accsub_t;                      /* Written by handle_timer0() */
+
+typedef struct {
+    acc64_t charge;             /* 1e-7 A x 1.024 mSec */
+    acc64_t energy;             /* 1e-7 W x 1.024 mSec */
+    uint32_t ticks;             /* 1.024 mSec ticks integrated */
+}accum_t;
+
+/* Baud rate table entry */
+
+#define BAUD_RATES      4
+#define BAUD_CONFIRM    92      /* Confirm time out, 3 Sec in 32.768 mSec ticks */
+
+typedef struct {
+    uint16_t brg;               /* SPBRGH:SPBRGL */
+    uint8_t packettime;         /* Packet timer reload, 1.024 mSec ticks */
+    uint8_t slot;               /* Default GSLT slot, 1.024 mSec ticks */
+}baudrate_t;
+
+/* Baud rate control block */
+
+typedef struct {
+    uint8_t rate;               /* Rate in use */
+    uint8_t next;               /* Rate to switch to */
+    uint8_t timer;              /* Confirm timer */
+    struct {
+        unsigned change : 1;    /* Switch once the response has gone */
+        unsigned confirm : 1;   /* Waiting for the master to confirm */
+    };
+}baud_t;
+
 /* EE Data */
 typedef union {
     struct {
         uint16_t sig;
         uint8_t  shunt_mv;
-        uint8_t pad1;
+        uint8_t baud;           /* Baud rate code, 0 = 9600 */
         uint16_t shunt_amps;
+        uint16_t stat_window;   /* Statistics window in seconds, 0 = until reset */
+        uint16_t alarm_limit[3]; /* Alarm limits in register counts, 0 = off */
+        uint16_t hist_period;   /* History period in seconds, 0 = off */
+        uint16_t ina_config;    /* INA226 config register, 0 = INA226_INIT_CONFIG */
 
 
     };
-    uint8_t bytes[16];
+    uint8_t bytes[24];
 } eedata_t;
 
 
@@ -160,7 +448,15 @@ typedef union {
 #ifdef BOOTAPP
 static bit enterbootloader = FALSE;
 #endif
-static volatile uint8_t ledactivitytimer = 0;
+static volatile uint8_t events = 0;             // Foreground events, EV_*
+static uint8_t ledactivitytimer = 0;
+static uint8_t eecursor = sizeof(eedata_t);     // Next config byte to save
+static struct {
+    eehistrec_t rec;                            // History record to spill
+    uint8_t addr;                               // Its EEPROM address
+    uint8_t left;                               // Bytes still to write
+} eespill;
+static volatile uint16_t slottimer = 0;         // Ticks until our GSLT slot
 static uint8_t crcreg = 0;
 static uint8_t myaddress = 0;
 static uint16_t ina226_cal;                     // INA226 calibration constant
@@ -168,71 +464,113 @@ static uint32_t current_lsb;                    // current lsb in 10exp-7 amps
 static uint32_t power_lsb;                      // power lsb (25x Current lsb)
 
 static volatile rxi_t   rxi;                    // Rcv interrupt handler vars
-static volatile pkt_t	pkt;			// Packet
+static volatile rxring_t rxring;                // Receive byte ring
+static volatile comms_t comms;                  // Communication counters
+static frame_t frames[2];                       // Received frame buffers
+static uint8_t irqpkt[PKTIRQLEN];               // IRQ packet buffer
 static volatile txi_t	txi;			// Tx interrupt handler vars
 static volatile irq_t	irq;			// IRQ variables
 static volatile phd_t	phd;			// Packet handler data
 static volatile i2c_t   i2c;                    // i2c control block
+static volatile sampler_t sampler;              // Background INA226 sampler
+static latch_t latch;                           // Snapshot latched by GSNP
+static volatile baud_t  baud;                   // Baud rate control block
+static volatile accsub_t accsub;                // Per tick sums
+static volatile stats_t stats;                  // Min/max/mean statistics
+static volatile alarm_t alarm;                  // Alarm limits and state
+static volatile uptime_t uptime;                // Up time clock
+static volatile hist_t hist;                    // Sample history
+static volatile diag_t diag;                    // Latency diagnostics
+static accum_t accum;                           // Running charge and energy
+static accum_t acclatch;                        // Latched by GACC
 static eedata_t eedata;                         // copy of EEPROM data in RAM
 
 /*
- * UART receive interrupt service
+ * Baud rates. The packet timer is scaled so a full size frame has about
+ * the same margin at every rate. The default slot fits a fully stuffed
+ * GSLT answer (38 characters) plus 2 ticks for timer jitter between nodes
  */
 
-static void handle_rda()
-{
-	rxi.c = RCREG;
-
-	irq.timer = irq.holdoff;
+static const baudrate_t baudrates[BAUD_RATES] = {
+    {SET_BAUD(9600), 0xFF, 42},
+    {SET_BAUD(38400), 64, 12},
+    {SET_BAUD(115200), 22, 6},
+    {SET_BAUD(250000), 10, 4}
+};
 
-	if(TRUE == rxi.pready)
-		return;
+/*
+ * Add a sample to one set of statistics. Min and max follow every
+ * sample; once count saturates the sum stops too, so the mean is
+ * that of the first 65535 samples
+ */
 
-	if(!rxi.sub){
-		if(STX == rxi.c)
-			rxi.state = RXI_INIT; // Start from beginning
-		else if(ETX == rxi.c){
-			rxi.state = RXI_FINISH; // Finish up
-		}
-		else if(SUBST == rxi.c){
-			rxi.sub = TRUE; // Next char is a substitution
-			return;
-		}
-	}
+static void stat_add(volatile stat_t *st, uint16_t v)
+{
+    if((!st->count) || (v < st->min))
+        st->min = v;
+    if((!st->count) || (v > st->max))
+        st->max = v;
+    if(0xFFFF == st->count)
+        return;
+    st->sum += v;
+    st->count++;
+}
 
+/*
+ * Add a time to a latency record. Called from interrupt context.
+ */
 
+static void lat_add(volatile lat_t *l, uint16_t t)
+{
+    uint8_t bin = 0;
+    uint16_t v = t >> 5;
 
-	switch(rxi.state){
+    stat_add(&l->stat, t);
+    while(v && (bin < DIAG_BINS - 1)){
+        v >>= 1;
+        bin++;
+    }
+    if(0xFFFF != l->bins[bin])
+        l->bins[bin]++;
+}
 
-		case	RXI_INIT:
-                        if(STX == rxi.c){
-                            rxi.packettimer = 0xFF;
-                            rxi.state = RXI_ASSEM;
-                            rxi.index = 0;
-                        }
-			break;
+/*
+ * UART receive interrupt service
+ */
 
-		case	RXI_ASSEM:
-			rxi.sub = FALSE;
-			if(rxi.index < MAXPACKET){
-				((uint8_t *) &pkt)[rxi.index++] = rxi.c;
-			}
-			break;
+static void handle_rda()
+{
+	uint8_t c, next, ferr;
 
+	ferr = RCSTAbits.FERR; // Belongs to the byte about to be read
+	c = RCREG;
 
-		case	RXI_FINISH:
-			rxi.sub = FALSE;
-			rxi.state = RXI_INIT;
-			rxi.pready = TRUE;
-			break;
+	irq.timer = irq.holdoff;
 
-		default:
-			rxi.state = RXI_INIT;
-			break;
+	if(ferr){ // Noise or a rate mismatch, the byte is garbage
+		comms.framing++;
+		return;
+	}
 
+	// Stamp for the turnaround. A stuffed 0x03 stamps too, the ETX after it
+	// overwrites that
+	if(ETX == c){
+		TMR1_READ(diag.rxstamp);
+		diag.rxtick = irq.prescale;
 	}
-	rxi.sub = FALSE;
 
+	// Push the byte, deframing is done by the foreground
+	next = (rxring.head + 1) & (RXRINGSIZE - 1);
+	if(next != rxring.tail){
+		rxring.buf[rxring.head] = c;
+		rxring.head = next;
+		rxring.dropping = FALSE;
+		POST(EV_RX);
+	}
+	else if(!rxring.dropping){ // Count each run once, it costs a frame
+		comms.dropped++;
+		rxring.dropping = TRUE;
+	}
 }
 
 /*
@@ -241,16 +579,35 @@ static void handle_rda()
 
 static void handle_tbe()
 {
+    uint16_t now;
+
     switch(txi.state){
             case TXI_INIT:
                     TXREG = STX; // Send Start of TX
                     txi.state = TXI_TXC;
                     txi.index = 0;
+                    if(txi.timed){ // First byte of a reply
+                        TMR1_READ(now);
+                        lat_add(&diag.turn, DIAG_SINCE(now, diag.rxstamp,
+                        diag.rxtick));
+                        txi.timed = FALSE;
+                    }
                     break;
 
 
             case TXI_TXC:
-                    txi.tchar = ((uint8_t *)&pkt)[txi.index++];
+                    if(txi.index == txi.dlen){ // Payload sent, append CRC
+                        txi.pktb[txi.index] = (uint8_t) txi.crc;
+                        if(txi.crcword)
+                            txi.pktb[txi.index + 1] = (uint8_t) (txi.crc >> 8);
+                    }
+                    txi.tchar = txi.pktb[txi.index];
+                    if(txi.index++ < txi.dlen){ // Fold payload into CRC
+                        if(txi.crcword)
+                            txi.crc = crc16_update(txi.crc, txi.tchar);
+                        else
+                            txi.crc = crc8_update((uint8_t) txi.crc, txi.tchar);
+                    }
                     if(txi.tchar <= SUBST){
                             TXREG = SUBST; // Send SUBST and return.
                             txi.state = TXI_TXC_POSTSUB;
@@ -272,6 +629,7 @@ static void handle_tbe()
                     txi.state = TXI_INIT;
                     PIE1bits.TXIE = FALSE; // Shut off TX interrupt
                     txi.txbusy = FALSE;
+                    POST(EV_TXDONE);
                     break;
 
             default:
@@ -282,36 +640,202 @@ static void handle_tbe()
 }
 
 /*
- * Timer interrupt service
+ * INA226 registers read by the background sampler, in order.
+ * The cycle only proceeds past the first Mask/Enable read when a new
+ * conversion is ready, which is polled on the timer tick. The three
+ * reads then take about 1.5 mSec at 100 kHz, and a conversion may end
+ * part way through them. Mask/Enable is read again after them and the
+ * snapshot is only published if no conversion has ended since the first
+ * read, so bus, current and power are always from the same conversion.
+ * GADC keeps conversions to INA226_MIN_CONV or longer, so at most a few
+ * are passed over.
  */
 
-static void handle_timer0() // 1.024 mSec
+static const uint8_t sampler_regs[] = {INA226_MASK, INA226_BUS,
+INA226_CURRENT, INA226_POWER, INA226_MASK};
+
+/*
+ * Start the next background sampler read. Called from interrupt context
+ * only when the I2C bus is idle.
+ */
+
+static void sampler_start(void)
+{
+    sampler.active = TRUE;
+    INA226_TRANS_START(sampler_regs[sampler.reg], 1, 0);
+}
+
+/*
+ * Check one snapshot value against an alarm limit, the alarm is pending
+ * on the rising edge only. Called from interrupt context.
+ */
+
+static void alarm_check(uint8_t which, uint16_t v)
+{
+    uint8_t mask = 1 << which;
+
+    if(alarm.limit[which] && (v > alarm.limit[which])){
+        if(!(alarm.active & mask))
+            alarm.pending |= mask;
+        alarm.active |= mask;
+    }
+    else
+        alarm.active &= ~mask;
+}
+
+/*
+ * Add a published snapshot to the statistics, rolling the window first
+ * if it has expired. Called from interrupt context.
+ */
+
+static void stats_update(volatile ina226snap_t *s)
 {
-    // Packet time out timer
-    if(RXI_ASSEM == rxi.state){
-        if(!rxi.packettimer){
-            phd.packettimeouts++;
-            rxi.state = RXI_INIT;
+    uint8_t i;
+
+    if(stats.expired){
+        for(i = 0; i < STAT_QUANTITIES; i++){
+            stats.last[i] = stats.live[i];
+            stats.live[i].count = 0;
+            stats.live[i].sum = 0;
         }
-        else
-            rxi.packettimer--;
+        stats.expired = FALSE;
+    }
+    stat_add(&stats.live[0], s->bus);
+    stat_add(&stats.live[1], s->current ^ STAT_BIAS);
+    stat_add(&stats.live[2], s->power);
+
+    alarm_check(1, (s->current & 0x8000) ? -s->current : s->current);
+    alarm_check(2, s->power);
+}
+
+/*
+ * Store the result of a background sampler read, publish the snapshot
+ * when all registers have been read, and chain the next read.
+ */
+
+static void sampler_next(void)
+{
+    volatile ina226snap_t *s = &sampler.snap[sampler.wr];
+
+    switch(sampler_regs[sampler.reg]){
+        case INA226_MASK:
+            if(sampler.reg){ /* After the reads */
+                if(INA226_RESULT & INA226_CVRF){
+                    sampler.reg = 0; /* Torn, wait for the next conversion */
+                    sampler.active = FALSE;
+                    return;
+                }
+            }
+            else if(!(INA226_RESULT & INA226_CVRF)){
+                sampler.active = FALSE; /* Not ready, retry next tick */
+                return;
+            }
+            break;
+
+        case INA226_BUS:
+            s->bus = INA226_RESULT;
+            break;
+
+        case INA226_CURRENT:
+            s->current = INA226_RESULT;
+            break;
+
+        case INA226_POWER:
+            s->power = INA226_RESULT;
+            break;
+    }
+
+    if(++sampler.reg >= sizeof(sampler_regs)){ /* Snapshot complete */
+        sampler.reg = 0;
+        stats_update(s);
+        sampler.wr ^= 1;
+        sampler.seq++;
+        sampler.valid = TRUE;
+        sampler.active = FALSE; /* Next cycle starts on the timer tick */
     }
+    else if(sampler.hold)
+        sampler.active = FALSE; /* Let the foreground have the bus */
+    else
+        sampler_start();
+}
+
+/*
+ * Return a consistent copy of the last published snapshot
+ */
+
+static bit sampler_read(ina226snap_t *snap)
+{
+    uint8_t seq;
+
+    if(!sampler.valid)
+        return ERR;
+    do{
+        seq = sampler.seq;
+        *snap = sampler.snap[sampler.wr ^ 1];
+    } while(seq != sampler.seq);
+    return NOERR;
+}
+
+/*
+ * Timer interrupt service
+ */
+
+static void handle_timer0() // 1.024 mSec
+{
+    // Packet time out timer, expiry is handled by deframe()
+    if((RXI_ASSEM == rxi.state) && (rxi.packettimer))
+        rxi.packettimer--;
     // Service interrupt holdoff timer
     if(0 == (irq.prescale & 0x1F)){ // 32.768 mSec
         if(irq.timer)
             irq.timer--;
+        if(baud.timer)
+            baud.timer--;
     }
 
     irq.prescale++;
 
-    // LED activity timer
-    if(ledactivitytimer){
-        ledactivitytimer--;
-        if(ledactivitytimer)
-            LED = 0;
-        else
-            LED = 1;
+    // Slotted response timer
+    if(slottimer)
+        slottimer--;
+
+    // Time in the packet handler state
+    if(0xFFFF != diag.phticks)
+        diag.phticks++;
+
+    // Up time clock, statistics window and history period
+    if(++uptime.ms >= TICKS_SEC){
+        uptime.ms = 0;
+        uptime.secs++;
+        if(stats.window && (++stats.secs >= stats.window)){
+            stats.secs = 0;
+            stats.expired = TRUE;
+        }
+        if(hist.period && (++hist.count >= hist.period)){
+            hist.count = 0;
+            hist.due = TRUE;
+        }
     }
+
+    // Integrate the last published snapshot over this tick
+    if(sampler.valid){
+        accsub.isum += (int16_t) sampler.snap[sampler.wr ^ 1].current;
+        accsub.psum += sampler.snap[sampler.wr ^ 1].power;
+        accsub.n++;
+    }
+
+    // Kick off the next background INA226 sample
+    if(sampler.run && !sampler.hold && !i2c.busy)
+        sampler_start();
+
+    // Wake the foreground, and its tasks with work waiting
+    POST(EV_TICK);
+    if(alarm.pending && !irq.flag)
+        POST(EV_ALARM);
+    if(hist.due)
+        POST(EV_HIST);
+    if(accsub.n >= ACC_FOLD)
+        POST(EV_FOLD);
 }
 
 /*
@@ -320,6 +844,8 @@ static void handle_timer0() // 1.024 mSec
 
 static void handle_i2c(void)
 {
+    uint16_t now;
+
     if(i2c.busy){
         switch(i2c.priv.state){
             case I2C_SEND_ADDR: /* Start complete */
@@ -387,8 +913,12 @@ static void handle_i2c(void)
                 break;
 
             case I2C_DONE:
+                TMR1_READ(now);
+                lat_add(&diag.i2c, now - diag.i2cstamp);
                 i2c.busy = FALSE;
                 i2c.priv.state = I2C_SEND_ADDR;
+                if(sampler.active)
+                    sampler_next();
                 break;
 
             default:
@@ -398,41 +928,90 @@ static void handle_i2c(void)
     }
 }
 
+/*
+ * Add a handler's time to its record. Called from interrupt context.
+ * The max follows every run; sum and count stop together before the
+ * sum would wrap, freezing the mean
+ */
+
+static void isr_account(volatile isrh_t *h, uint16_t t)
+{
+    if(t > h->max)
+        h->max = t;
+    if(h->sum > 0xFFFFFFFFUL - t)
+        return;
+    h->sum += t;
+    h->count++;
+}
+
+/* Time the handler just run, from the end of the one before */
+#define DIAG_HANDLER(H) {TMR1_READ(t1); isr_account(&diag.hnd[H], t1 - t0);\
+t0 = t1;}
+
 /*
  * Interrupt service routine
  */
 
 interrupt void isr(void)
 {
+    uint16_t ts, t0, t1;
 
+    TMR1_READ(ts);
+    t0 = ts;
 
     /* UART Receive */
     if(PIR1bits.RCIF){
             handle_rda();
             PIR1bits.RCIF = FALSE;
+            DIAG_HANDLER(DIAG_RDA);
+    }
+
+    /*
+     * UART overrun. The receiver stops until CREN is cleared, which
+     * clears OERR. Checked on every entry as an overrun raises no
+     * interrupt of its own, so the timer tick bounds the deaf time
+     */
+    if(RCSTAbits.OERR){
+        RCSTAbits.CREN = FALSE;
+        RCSTAbits.CREN = TRUE;
+        comms.overruns++;
     }
 
     /* Timer */
     if(INTCONbits.T0IF){
         INTCONbits.T0IF = FALSE;
         handle_timer0();
-
+        DIAG_HANDLER(DIAG_TMR0);
     }
    
     /* I2C */
     if(PIR1bits.SSP1IF){
         PIR1bits.SSP1IF = FALSE;
         handle_i2c();
-   
+        DIAG_HANDLER(DIAG_I2CH);
     }
 
 
+    /* INA226 ALERT, falling edge on INT */
+    if(INTCONbits.INTF){
+        INTCONbits.INTF = FALSE;
+        alarm.pending |= ALARM_UV;
+        DIAG_HANDLER(DIAG_INT);
+    }
+
     /* UART Transmit */
     if(PIE1bits.TXIE && PIR1bits.TXIF){
         PIR1bits.TXIF = FALSE;
         handle_tbe();
+        DIAG_HANDLER(DIAG_TBE);
     }
 
+    /* Time spent in here, less the context save */
+    TMR1_READ(t1);
+    t1 -= ts;
+    diag.isrcount++;
+    if(t1 > diag.isrmax)
+        diag.isrmax = t1;
 }
 
 
@@ -456,79 +1035,118 @@ static void eeprom_to_ram(void *ram, uint8_t eeaddr, uint8_t size)
 static void ram_to_eeprom(uint8_t eeaddr, void *ram, uint8_t size)
 {
     int i;
-    for(i = 0 ; i < size ; i++)
-        eeprom_write(eeaddr + i, ((uint8_t *) ram)[i]);
+    for(i = 0 ; i < size ; i++){
+        // Skip bytes which are already correct, saves time and wear
+        if(eeprom_read(eeaddr + i) != ((uint8_t *) ram)[i])
+            eeprom_write(eeaddr + i, ((uint8_t *) ram)[i]);
+    }
 }
 
+/*
+ * Save the config block. The write is left to ee_task(), so the reply
+ * does not wait for it
+ */
 
-static void calc_ina226_cal(void)
+static void ee_save(void)
 {
-    uint32_t a107, rs107;
+    eecursor = 0;
+    POST(EV_EESAVE);
+}
 
-    a107 = 10000000 * eedata.shunt_amps;
-    rs107 = (eedata.shunt_mv*(10000000/1000))/eedata.shunt_amps;
+/*
+ * Switch the UART to a rate from the baud rate table. A frame being
+ * assembled can no longer complete, so it is dropped
+ */
 
-    current_lsb = a107 >> 15;
-    power_lsb = 25 * current_lsb;
-    ina226_cal = (uint16_t) ((512000000)/((current_lsb * rs107 )/1000));
-    return;
+static void set_baud(uint8_t rate)
+{
+    baud.rate = rate;
+    SPBRGH = (uint8_t) (baudrates[rate].brg >> 8);
+    SPBRGL = (uint8_t) baudrates[rate].brg;
+    rxi.state = RXI_INIT;
 }
 
+
 /*
-* Calculate 8 bit CRC
-*/
+ * Calculate the INA226 calibration and LSB's for the configured shunt
+ */
 
-static uint8_t calc_crc(uint8_t *p, uint8_t len)
+static void calc_ina226_cal(void)
 {
-    uint8_t theBits, fb;
-    uint8_t i, j;
+    inacal_t c;
 
-    for(i = 0 ; i < len ; i++)
-    {
-        CLRWDT();
-        theBits = *p++;
-        for(j = 0 ; j < 8 ; j++)
-        {
-            fb = (theBits ^ crcreg) & 1;
-            crcreg >>= 1;
-            if(fb)
-                crcreg ^= POLY;
-            theBits >>= 1;
-        }
+    inacal_calc(&c, eedata.shunt_amps, eedata.shunt_mv);
+    ina226_cal = c.cal;
+    current_lsb = c.current_lsb;
+    power_lsb = c.power_lsb;
+}
+
+/*
+ * Add or subtract the 64 bit product a * b to or from an accumulator
+ */
+
+static void acc_add(acc64_t *acc, uint32_t a, uint32_t b, uint8_t neg)
+{
+    uint32_t ll, lh, hl, mid, lo, hi;
+
+    // 32 x 32 multiply from 16 x 16 partial products
+    ll = (a & 0xFFFF) * (b & 0xFFFF);
+    lh = (a & 0xFFFF) * (b >> 16);
+    hl = (a >> 16) * (b & 0xFFFF);
+    hi = (a >> 16) * (b >> 16);
+    mid = (ll >> 16) + (lh & 0xFFFF) + (hl & 0xFFFF);
+    lo = (ll & 0xFFFF) | (mid << 16);
+    hi += (lh >> 16) + (hl >> 16) + (mid >> 16);
+
+    if(neg){
+        acc->hi -= hi + (acc->lo < lo);
+        acc->lo -= lo;
+    }
+    else{
+        acc->lo += lo;
+        acc->hi += hi + (acc->lo < lo);
     }
-    return crcreg;
 }
 
+/*
+ * Move the per tick sums into the 64 bit accumulators, scaled by the
+ * LSB's in force while they were summed
+ */
+
+static void acc_fold(void)
+{
+    int32_t isum;
+    uint32_t psum;
+    uint16_t n;
+
+    di();
+    isum = accsub.isum;
+    psum = accsub.psum;
+    n = accsub.n;
+    accsub.isum = 0;
+    accsub.psum = 0;
+    accsub.n = 0;
+    ei();
+
+    if(isum < 0)
+        acc_add(&accum.charge, (uint32_t) -isum, current_lsb, TRUE);
+    else
+        acc_add(&accum.charge, (uint32_t) isum, current_lsb, FALSE);
+    acc_add(&accum.energy, psum, power_lsb, FALSE);
+    accum.ticks += n;
+}
 
 /*
- * Calculate 16 bit CRC over buffer using polynomial
+* Calculate 8 bit CRC
 */
 
-uint16_t calc_crc16(uint16_t crcin, uint8_t *buf, uint8_t len)
+static uint8_t calc_crc(uint8_t *p, uint8_t len)
 {
-    uint8_t i,j;
-    static bit dogen;
-    union{
-        uint16_t word;
-        struct{
-            uint8_t low;
-            uint8_t high;
-        };
-    } crc;
-    
-    crc.word = crcin;
-    for(i = 0; i < len; i++){
-        CLRWDT();
-        crc.high ^= buf[i];
-        for(j = 0; j < 8; j++){
-            dogen = ((crc.high & 0x80) != 0);
-            crc.word <<= 1;
-            if(dogen){
-                crc.word ^= POLY16;
-            }
-        }
-    }
-    return crc.word;
+    uint8_t i;
+
+    for(i = 0 ; i < len ; i++)
+        crcreg = crc8_update(crcreg, *p++);
+    return crcreg;
 }
 
 
@@ -552,34 +1170,50 @@ static bit txisempty()
 
 static bit do_gnid(uint8_t len, volatile uint8_t *params)
 {
-
-    if(4 == len){
-            params[0] = (uint8_t) MODULEID;
-            params[1] = (uint8_t) (MODULEID >> 8);
-            params[2] = (uint8_t) VERSION;
-            params[3] = (uint8_t) (VERSION >> 8);
-            return NOERR;
-    }
-    else
-            return ERR;
+    params[0] = (uint8_t) MODULEID;
+    params[1] = (uint8_t) (MODULEID >> 8);
+    params[2] = (uint8_t) VERSION;
+    params[3] = (uint8_t) (VERSION >> 8);
+    return NOERR;
 }
 
 /*
-* Return comm status
+* Return comm status. A reset clears the GCSX CRC error and time out
+* counters, as these are their low bytes
 */
 
 static bit do_gcst(uint8_t len, volatile uint8_t *params)
 {
+	params[1] = (uint8_t) comms.crcerrs;
+	params[2] = (uint8_t) comms.timeouts;
+	if(params[0])
+		comms.crcerrs = comms.timeouts = 0;
+	return NOERR;
+}
 
-	if(3 == len){
-		params[1] = phd.crcerrs;
-		params[2] = phd.packettimeouts;
-		if(params[0])
-			phd.crcerrs = phd.packettimeouts = 0;
-		return NOERR;
-	}
-	else
-		return ERR;
+/*
+ * Return the full width communication counters, and optionally reset them
+ */
+
+static bit do_gcsx(uint8_t len, volatile uint8_t *params)
+{
+    uint32_t *p = (uint32_t *) (params + 1);
+
+    if(params[0] > 1)
+        return ERR;
+    di();
+    p[0] = comms.crcerrs;
+    p[1] = comms.timeouts;
+    p[2] = comms.overruns;
+    p[3] = comms.framing;
+    p[4] = comms.dropped;
+    p[5] = comms.frames;
+    if(params[0]){
+        comms.crcerrs = comms.timeouts = comms.overruns = 0;
+        comms.framing = comms.dropped = comms.frames = 0;
+    }
+    ei();
+    return NOERR;
 }
 
 /*
@@ -603,10 +1237,10 @@ static bit do_volts(uint8_t len, volatile uint8_t *params)
 {
     uint16_t x;
     uint32_t *p = (uint32_t *) (params + 4);
+    ina226snap_t snap;
 
-    if((8 == len) && (!params[0])){
-        INA226_TRANS_WAIT(INA226_BUS, 1, 0);
-        x = INA226_RESULT;
+    if((!params[0]) && (NOERR == sampler_read(&snap))){
+        x = snap.bus;
         params[1] = VMAG; // Magnitude
         params[2] = (uint8_t) x;
         params[3] = (uint8_t)(x >> 8);
@@ -625,10 +1259,10 @@ static bit do_current(uint8_t len, volatile uint8_t *params)
 {
     uint16_t x;
     uint32_t *p = (uint32_t *) (params + 4);
+    ina226snap_t snap;
 
-    if((8 == len) && (!params[0])){
-        INA226_TRANS_WAIT(INA226_CURRENT, 1, 0);
-        x = INA226_RESULT;
+    if((!params[0]) && (NOERR == sampler_read(&snap))){
+        x = snap.current;
         params[1] = CMAG; // Magnitude
         params[2] = (uint8_t) x;
         params[3] = (uint8_t)(x >> 8);
@@ -649,10 +1283,10 @@ static bit do_power(uint8_t len, volatile uint8_t *params)
 {
     uint16_t x;
     uint32_t *p = (uint32_t *) (params + 4);
+    ina226snap_t snap;
 
-    if((8 == len) && (!params[0])){
-        INA226_TRANS_WAIT(INA226_POWER, 1, 0);
-        x = INA226_RESULT;
+    if((!params[0]) && (NOERR == sampler_read(&snap))){
+        x = snap.power;
         params[1] = PMAG; // Magnitude
         params[2] = (uint8_t) x;
         params[3] = (uint8_t)(x >> 8);
@@ -665,34 +1299,567 @@ static bit do_power(uint8_t len, volatile uint8_t *params)
 }
 
 /*
- * Allow user to read and write the shunt config
+ * Return voltage, current and power from the same conversion
+ */
+
+static bit do_vip(uint8_t len, volatile uint8_t *params)
+{
+    uint32_t *p = (uint32_t *) (params + 8);
+    ina226snap_t snap;
+
+    if((!params[0]) && (NOERR == sampler_read(&snap))){
+        params[1] = CMAG; // Magnitude of current and power lsb
+        params[2] = (uint8_t) snap.bus;
+        params[3] = (uint8_t)(snap.bus >> 8);
+        params[4] = (uint8_t) snap.current;
+        params[5] = (uint8_t)(snap.current >> 8);
+        params[6] = (uint8_t) snap.power;
+        params[7] = (uint8_t)(snap.power >> 8);
+        *p = current_lsb;
+        return NOERR;
+    }
+    return ERR;
+
+}
+
+/*
+ * Latch the last published snapshot under a tag, or return the latched
+ * snapshot in the GVIP layout along with its tag. Broadcast, the latch
+ * captures every node's readings at the same instant, to within one
+ * conversion period, and the host can then read the nodes back in any
+ * order
+ */
+
+static bit do_gsnp(uint8_t len, volatile uint8_t *params)
+{
+    uint32_t *p = (uint32_t *) (params + 9);
+
+    if(1 == params[0]){ /* Latch */
+        latch.valid = FALSE;
+        if(ERR == sampler_read(&latch.snap))
+            return ERR;
+        latch.tag = params[1];
+        latch.valid = TRUE;
+        if(2 == len)
+            return NOERR;
+    }
+    else if((13 != len) || (0 != params[0]) || (!latch.valid))
+        return ERR;
+    params[1] = latch.tag;
+    params[2] = CMAG; // Magnitude of current and power lsb
+    params[3] = (uint8_t) latch.snap.bus;
+    params[4] = (uint8_t)(latch.snap.bus >> 8);
+    params[5] = (uint8_t) latch.snap.current;
+    params[6] = (uint8_t)(latch.snap.current >> 8);
+    params[7] = (uint8_t) latch.snap.power;
+    params[8] = (uint8_t)(latch.snap.power >> 8);
+    *p = current_lsb;
+    return NOERR;
+}
+
+/*
+ * Slotted broadcast read. Nodes from base to base + count - 1 latch a
+ * snapshot as GSNP does, and each answers with it in slot (address -
+ * base), counted from the end of the broadcast, so one request collects
+ * the whole bus. A slot of 0 picks the default for the baud rate
+ */
+
+static bit do_gslt(uint8_t len, volatile uint8_t *params)
+{
+    uint8_t tag = params[0];
+    uint8_t index = myaddress - params[1];
+    uint8_t slot = (params[3]) ? params[3] : baudrates[baud.rate].slot;
+
+    if((myaddress < params[1]) || (index >= params[2]))
+        return ERR;
+    params[0] = 1;
+    params[1] = tag;
+    if(ERR == do_gsnp(13, params))
+        return ERR;
+    phd.rlen = 13;
+    di();
+    slottimer = (uint16_t) index * slot;
+    ei();
+    return NOERR;
+}
+
+/*
+ * Latch, reset and return the charge and energy accumulators. The latch
+ * captures all three values at the same instant, so a broadcast latch
+ * followed by unicast reads gives every node the same interval. A
+ * broadcast must latch, a plain read could not be answered
+ */
+
+static bit do_gacc(uint8_t len, volatile uint8_t *params)
+{
+    uint32_t *p = (uint32_t *) (params + 3);
+
+    if(phd.bcast && !(params[0] & ACC_LATCH))
+        return ERR;
+    if(params[1] <= 2){
+        if(params[0] & ACC_LATCH){
+            acc_fold();
+            acclatch = accum;
+            if(params[0] & ACC_RESET){
+                accum.charge.lo = accum.charge.hi = 0;
+                accum.energy.lo = accum.energy.hi = 0;
+                accum.ticks = 0;
+            }
+        }
+        params[2] = CMAG; // Magnitude
+        if(0 == params[1]){
+            p[0] = acclatch.charge.lo;
+            p[1] = acclatch.charge.hi;
+        }
+        else if(1 == params[1]){
+            p[0] = acclatch.energy.lo;
+            p[1] = acclatch.energy.hi;
+        }
+        else{
+            p[0] = acclatch.ticks;
+            p[1] = 0;
+        }
+        return NOERR;
+    }
+    return ERR;
+}
+
+/*
+ * Return min, max, mean and sample count for one quantity, for the window
+ * in progress or the last completed one, or set the window length. Values
+ * are raw INA226 register counts, scaled as for GVIP. A broadcast may only
+ * reset or set the window, the reads could not be answered
+ */
+
+static bit do_gsta(uint8_t len, volatile uint8_t *params)
+{
+    uint16_t *words = (uint16_t *) params;
+    uint8_t i, q = params[1];
+    stat_t st;
+    uint16_t mean;
+
+    if((params[0] > 3) || (phd.bcast && (params[0] != 1) && (params[0] != 3)))
+        return ERR;
+
+    if(3 == params[0]){ /* Set window, restarts all statistics */
+        di();
+        stats.window = words[1];
+        stats.secs = 0;
+        stats.expired = FALSE;
+        for(i = 0; i < STAT_QUANTITIES; i++)
+            stats.live[i].count = stats.last[i].count = 0;
+        ei();
+        eedata.stat_window = words[1];
+        ee_save();
+        return NOERR;
+    }
+
+    if(q >= STAT_QUANTITIES)
+        return ERR;
+    di();
+    if(2 == params[0])
+        st = stats.last[q];
+    else{
+        st = stats.live[q];
+        if(1 == params[0]){
+            for(i = 0; i < STAT_QUANTITIES; i++){
+                stats.live[i].count = 0;
+                stats.live[i].sum = 0;
+            }
+        }
+    }
+    ei();
+
+    mean = (st.count) ? (uint16_t) (st.sum / st.count) : 0;
+    if(1 == q){ // Current is signed
+        st.min ^= STAT_BIAS;
+        st.max ^= STAT_BIAS;
+        mean ^= STAT_BIAS;
+    }
+    words[1] = st.min;
+    words[2] = st.max;
+    words[3] = mean;
+    words[4] = st.count;
+    return NOERR;
+}
+
+/*
+ * Return latency diagnostics, and optionally reset the block read. The
+ * turnaround runs from the last request byte in to the first reply byte
+ * out, slotted replies are not timed. The isr() block gives the longest
+ * entry and the entries, then for each handler the longest run, the
+ * total and the runs. The phase times are the longest stay in each
+ * packet handler state, PHD_START's being the longest wait for a
+ * request, to the tick past 65 mSec and saturating at 67 seconds. Times
+ * are in uSec
+ */
+
+static const uint8_t diag_len[] = {DIAG_LATLEN, DIAG_LATLEN, DIAG_ISRLEN,
+DIAG_PHASELEN};
+
+static bit do_gdia(uint8_t len, volatile uint8_t *params)
+{
+    uint16_t *words = (uint16_t *) params;
+    uint32_t *p = (uint32_t *) (params + 2);
+    volatile uint8_t *h;
+    volatile lat_t *l;
+    lat_t lt;
+    uint8_t i;
+
+    if((params[0] > 1) || (params[1] > DIAG_PHASE) ||
+    (len != diag_len[params[1]]))
+        return ERR;
+
+    if(DIAG_ISR == params[1]){
+        di();
+        words[1] = diag.isrmax;
+        *(uint32_t *) (params + 4) = diag.isrcount;
+        for(i = 0, h = params + 8; i < DIAG_HANDLERS; i++, h += 10){
+            *(uint16_t *) h = diag.hnd[i].max;
+            *(uint32_t *) (h + 2) = diag.hnd[i].sum;
+            *(uint32_t *) (h + 6) = diag.hnd[i].count;
+            if(params[0]){
+                diag.hnd[i].max = 0;
+                diag.hnd[i].sum = 0;
+                diag.hnd[i].count = 0;
+            }
+        }
+        if(params[0]){
+            diag.isrmax = 0;
+            diag.isrcount = 0;
+        }
+        ei();
+        return NOERR;
+    }
+
+    if(DIAG_PHASE == params[1]){
+        for(i = 0; i < PHD_STATES; i++){
+            p[i] = diag.phase[i];
+            if(params[0])
+                diag.phase[i] = 0;
+        }
+        return NOERR;
+    }
+
+    l = (DIAG_TURN == params[1]) ? &diag.turn : &diag.i2c;
+    di();
+    lt = *l;
+    if(params[0]){
+        l->stat.count = 0;
+        l->stat.sum = 0;
+        for(i = 0; i < DIAG_BINS; i++)
+            l->bins[i] = 0;
+    }
+    ei();
+    words[1] = lt.stat.min;
+    words[2] = lt.stat.max;
+    words[3] = (lt.stat.count) ? (uint16_t) (lt.stat.sum / lt.stat.count) : 0;
+    words[4] = lt.stat.count;
+    for(i = 0; i < DIAG_BINS; i++)
+        words[5 + i] = lt.bins[i];
+    return NOERR;
+}
+
+/*
+ * Program the under voltage limit into the INA226 and arm the ALERT
+ * interrupt. ALERT is left in transparent mode so it follows the condition
+ */
+
+static void alarm_program(void)
+{
+    INA226_TRANS_WAIT(INA226_ALERTLIM, 0, alarm.limit[0]);
+    INA226_TRANS_WAIT(INA226_MASK, 0, (alarm.limit[0]) ? INA226_BUL : 0);
+    INTCONbits.INTF = FALSE;
+    INTCONbits.INTE = (alarm.limit[0]) ? TRUE : FALSE;
+    if(alarm.limit[0] && !ALERT){ // Already under, no edge to come
+        di();
+        alarm.pending |= ALARM_UV;
+        ei();
+    }
+}
+
+/*
+ * Read or write an alarm limit. Limits are in register counts, bus
+ * voltage for under voltage, current magnitude and power for the others.
+ * The last byte returns the alarms which are currently active
+ */
+
+static bit do_galm(uint8_t len, volatile uint8_t *params)
+{
+    uint16_t *words = (uint16_t *) (params + 2);
+    uint8_t which = params[1];
+
+    if(which >= ALARMS)
+        return ERR;
+    if(0 == params[0]) /* Read */
+        words[0] = alarm.limit[which];
+    else if(1 == params[0]){ /* Write */
+        di();
+        alarm.limit[which] = words[0];
+        alarm.active &= ~(1 << which);
+        ei();
+        if(0 == which)
+            alarm_program();
+        eedata.alarm_limit[which] = words[0];
+        ee_save();
+    }
+    else
+        return ERR;
+    params[4] = alarm.active | ((alarm.limit[0] && !ALERT) ? ALARM_UV : 0);
+    return NOERR;
+}
+
+/*
+ * Take a history record when one is due. The oldest RAM record is spilled
+ * to EEPROM first if spilling is on. ee_task() writes the spill a byte at
+ * a time, so the receive ring keeps draining
+ */
+
+static void hist_poll(void)
+{
+    volatile histrec_t *r;
+    ina226snap_t snap;
+
+    if((!hist.due) || (ERR == sampler_read(&snap)))
+        return;
+    hist.due = FALSE;
+
+    r = &hist.ring[hist.seq & (HIST_RECORDS - 1)];
+    if(hist.spill && (hist.held >= HIST_RECORDS)){
+        eespill.rec.seq = hist.seq - HIST_RECORDS;
+        eespill.rec.rec = *r;
+        eespill.addr = EEHISTSTART + (eespill.rec.seq % EEHISTRECORDS) *
+        sizeof(eehistrec_t);
+        eespill.left = sizeof(eehistrec_t);
+        POST(EV_EESAVE);
+    }
+    di();
+    r->time = (uint16_t) uptime.secs;
+    ei();
+    r->bus = snap.bus;
+    r->current = snap.current;
+    hist.seq++;
+    if(hist.held < HIST_RECORDS + ((hist.spill) ? EEHISTRECORDS : 0))
+        hist.held++;
+}
+
+/*
+ * Append a signed 16 bit delta as a zig-zag varint. Continuation bytes
+ * carry 7 bits with the top bit set, the final byte carries what is left
+ * (under PK_LAST) plus SUBST + 1, so no byte ever needs stuffing. Deltas
+ * of +/-61 take one byte
+ */
+
+static volatile uint8_t *put_delta(volatile uint8_t *out, uint16_t delta)
+{
+    uint16_t z = (delta << 1) ^ ((delta & 0x8000) ? 0xFFFF : 0);
+
+    while(z >= PK_LAST){
+        *out++ = 0x80 | ((uint8_t) z & 0x7F);
+        z >>= 7;
+    }
+    *out++ = (uint8_t) z + SUBST + 1;
+    return out;
+}
+
+/*
+ * Read a page of history records, or set or read the period. A page
+ * starts at the cursor, or at the oldest record held if the cursor is
+ * older, and returns the sequence number of its first record, the count,
+ * the sequence number of the next record to be taken and the up time, so
+ * the host can resume from first + count and date each record. A page
+ * is longer than the request, it goes back as an extended frame.
+ * Asked for packed (HDCPK), each record is instead sent as the deltas of
+ * its time, bus and current from the record before, the first from 0,
+ * which fits about twice the records in a page with no stuffing
+ */
+
+static bit do_ghis(uint8_t len, volatile uint8_t *params)
+{
+    uint16_t *first = (uint16_t *) (params + 1);
+    uint16_t *next = (uint16_t *) (params + 4);
+    uint16_t *now = (uint16_t *) (params + 6);
+    volatile uint8_t *out = params + HIST_PAGEHDR;
+    volatile uint8_t *end = params + MAXXPARAMS - 2;
+    volatile histrec_t *r;
+    eehistrec_t ee;
+    histrec_t prev;
+    uint16_t cursor;
+    uint8_t n, max;
+
+    if((3 == len) && (1 == params[0])){ /* Set period, clears the history */
+        di();
+        hist.period = *first & ~HIST_SPILL;
+        hist.count = 0;
+        ei();
+        hist.spill = (*first & HIST_SPILL) ? TRUE : FALSE;
+        hist.held = 0;
+        eedata.hist_period = *first;
+        ee_save();
+        return NOERR;
+    }
+    if((3 == len) && (2 == params[0])){ /* Read period */
+        *first = eedata.hist_period;
+        return NOERR;
+    }
+    if((4 != len) || (0 != params[0]))
+        return ERR;
+
+    cursor = *first;
+    max = (phd.pack || (params[3] < HIST_PAGEMAX)) ? params[3] : HIST_PAGEMAX;
+    prev.time = prev.bus = prev.current = 0;
+    if((uint16_t) (hist.seq - cursor) > hist.held)
+        cursor = hist.seq - hist.held;
+    for(n = 0; (n < max) && ((uint16_t) (cursor + n) != hist.seq); n++){
+        if((uint16_t) (hist.seq - (cursor + n)) <= HIST_RECORDS)
+            r = &hist.ring[(cursor + n) & (HIST_RECORDS - 1)];
+        else{
+            eeprom_to_ram(&ee, EEHISTSTART + ((uint16_t) (cursor + n) %
+            EEHISTRECORDS) * sizeof(eehistrec_t), sizeof(ee));
+            if(ee.seq != (uint16_t) (cursor + n))
+                break;
+            r = &ee.rec;
+        }
+        if(phd.pack){
+            if(out + HIST_PKRECMAX > end)
+                break;
+            out = put_delta(out, r->time - prev.time);
+            out = put_delta(out, r->bus - prev.bus);
+            out = put_delta(out, r->current - prev.current);
+            prev = *r;
+            continue;
+        }
+        out[0] = (uint8_t) r->time;
+        out[1] = (uint8_t) (r->time >> 8);
+        out[2] = (uint8_t) r->bus;
+        out[3] = (uint8_t) (r->bus >> 8);
+        out[4] = (uint8_t) r->current;
+        out[5] = (uint8_t) (r->current >> 8);
+        out += HIST_RECLEN;
+    }
+    *first = cursor;
+    params[3] = n;
+    *next = hist.seq;
+    di();
+    *now = (uint16_t) uptime.secs;
+    ei();
+    phd.rlen = (uint8_t) (out - params);
+    phd.packed = phd.pack;
+    return NOERR;
+}
+
+/*
+ * Return the INA226 config register value for the saved profile, 0 is
+ * the power up default
+ */
+
+static uint16_t ina226_config(void)
+{
+    return (eedata.ina_config) ? eedata.ina_config : INA226_INIT_CONFIG;
+}
+
+/*
+ * INA226 conversion time in uSec for each code, and the averaging
+ * count for each code as a power of 2
+ */
+
+static const uint16_t ina226_ct[] = {140, 204, 332, 588, 1100, 2116, 4156,
+8244};
+static const uint8_t ina226_avg[] = {0, 2, 4, 6, 7, 8, 9, 10};
+
+/*
+ * Read or write the INA226 averaging count and the bus and shunt
+ * conversion times, as the 3 bit codes of the config register. A write
+ * takes effect from the next conversion and is saved. Profiles which
+ * convert faster than INA226_MIN_CONV are refused, the sampler could
+ * not read them whole
+ */
+
+static bit do_gadc(uint8_t len, volatile uint8_t *params)
+{
+    uint16_t config;
+
+    if(1 == params[0]){ /* Write */
+        if((params[1] > INA226_FIELD) || (params[2] > INA226_FIELD) ||
+        (params[3] > INA226_FIELD))
+            return ERR;
+        if((((uint32_t) (ina226_ct[params[2]] + ina226_ct[params[3]])) <<
+        ina226_avg[params[1]]) < INA226_MIN_CONV)
+            return ERR;
+        eedata.ina_config = ((uint16_t) params[1] << INA226_AVG_SHIFT) |
+        ((uint16_t) params[2] << INA226_VBUSCT_SHIFT) |
+        ((uint16_t) params[3] << INA226_VSHCT_SHIFT) | INA226_MODE_CONT;
+        INA226_TRANS_WAIT(INA226_CONFIG, 0, eedata.ina_config);
+        ee_save();
+    }
+    else if(0 != params[0])
+        return ERR;
+    config = ina226_config();
+    params[1] = (config >> INA226_AVG_SHIFT) & INA226_FIELD;
+    params[2] = (config >> INA226_VBUSCT_SHIFT) & INA226_FIELD;
+    params[3] = (config >> INA226_VSHCT_SHIFT) & INA226_FIELD;
+    return NOERR;
+}
+
+/*
+ * Allow user to read and write the shunt config
  */
 
 static bit do_shunt_config(uint8_t len, volatile uint8_t *params)
 {
     uint16_t *words = (uint16_t *) params;
 
-    if(4 == len){
-        if( 0 == params[0]){ /* Read config? */
-            words[1] = eedata.shunt_amps;
-            params[1] = eedata.shunt_mv;
+    if( 0 == params[0]){ /* Read config? */
+        words[1] = eedata.shunt_amps;
+        params[1] = eedata.shunt_mv;
+        return NOERR;
+    }
+    else if(1 == params[0]){ /* Write config? */
+        // sanity check values
+        if((words[1] <= INACAL_AMPS_MAX) && (words[1] > 0) &&
+           (params[1] <= INACAL_MV_MAX && (params[1] > 0))){
+            eedata.shunt_amps = words[1];
+            eedata.shunt_mv = params[1];
+            acc_fold(); // Sums so far are at the old LSB
+            calc_ina226_cal(); // calculate new cal value
+            INA226_TRANS_WAIT(INA226_CAL, 0, ina226_cal); // update cal
+            ee_save(); // eeprom write
             return NOERR;
         }
-        else if(1 == params[0]){ /* Write config? */
-            // sanity check values
-            if((words[1] <= 200) && (words[1] > 0) &&
-               (params[1] <= 80 && (params[1] > 0))){
-                eedata.shunt_amps = words[1];
-                eedata.shunt_mv = params[1];
-                calc_ina226_cal(); // calculate new cal value
-                INA226_TRANS_WAIT(INA226_CAL, 0, ina226_cal); // update cal
-                ram_to_eeprom(0, &eedata, sizeof(eedata)); // eeprom write
-                return NOERR;
-            }
+    }
+    else if (2 == params[0]){ /* Return cal for diagnostic purposes */
+        params[1] = 0;
+        words[0] = ina226_cal; // send cal back with return data
+        return NOERR;
+    }
+    return ERR;
+}
+
+/*
+ * Read, switch or confirm the baud rate. A switch takes effect once the
+ * response has been sent and must be confirmed at the new rate before the
+ * confirm timer expires, or the node goes back to the saved rate
+ */
+
+static bit do_gbau(uint8_t len, volatile uint8_t *params)
+{
+    if(0 == params[1]){ /* Read */
+        params[0] = baud.rate;
+        params[1] = baud.confirm;
+        return NOERR;
+    }
+    else if(1 == params[1]){ /* Switch */
+        if(params[0] < BAUD_RATES){
+            baud.next = params[0];
+            baud.change = TRUE;
+            return NOERR;
         }
-        else if (2 == params[0]){ /* Return cal for diagnostic purposes */
-            params[1] = 0;
-            words[0] = ina226_cal; // send cal back with return data
+    }
+    else if(2 == params[1]){ /* Confirm and save */
+        if(params[0] == baud.rate){
+            baud.confirm = FALSE;
+            eedata.baud = baud.rate;
+            ee_save();
             return NOERR;
         }
     }
@@ -708,52 +1875,47 @@ static bit do_gout(uint8_t len, volatile uint8_t *params)
 {
 	uint8_t res;
 
-	if(len == 3){
-		if(params[0] > 1) // Channel
-			return ERR;
-		if(params[2] != 0) // Result
-			return ERR;
-		switch(params[1]){ // Command
-			case 0:
-                                switch(params[0]){
-                                    case 0:
-                                        OD1 = OFF;
-                                        break;
-                                    case 1:
-                                        OD2 = OFF;
-                                        break;
-                                }
-				break;
-
-			case 1:
-                                switch(params[0]){
-                                    case 0:
-                                        OD1 = ON;
-                                        break;
-                                    case 1:
-                                        OD2 = ON;
-                                        break;
-                                }
-				break;
-			case 2:
-				switch(params[0]){
-					case 0:
-						res = OD1;
-						break;
-					case 1:
-						res = OD2;
-						break;
-				}
-				params[2] = res;
-				break;
-			default:
-				return ERR;
-		}
-		return NOERR;
-	}
-	else
+	if(params[0] > 1) // Channel
 		return ERR;
+	if(params[2] != 0) // Result
+		return ERR;
+	switch(params[1]){ // Command
+		case 0:
+                        switch(params[0]){
+                            case 0:
+                                OD1 = OFF;
+                                break;
+                            case 1:
+                                OD2 = OFF;
+                                break;
+                        }
+			break;
 
+		case 1:
+                        switch(params[0]){
+                            case 0:
+                                OD1 = ON;
+                                break;
+                            case 1:
+                                OD2 = ON;
+                                break;
+                        }
+			break;
+		case 2:
+			switch(params[0]){
+				case 0:
+					res = OD1;
+					break;
+				case 1:
+					res = OD2;
+					break;
+			}
+			params[2] = res;
+			break;
+		default:
+			return ERR;
+	}
+	return NOERR;
 }
 
 /*
@@ -769,54 +1931,316 @@ static void raise_irq(uint8_t reason)
 
 }
 
+/*
+ * Raise an IRQ for the next pending alarm once the previous IRQ has been
+ * polled, so no reason is overwritten
+ */
+
+static void alarm_poll(void)
+{
+    uint8_t i;
+
+    if(irq.flag || !alarm.pending)
+        return;
+    for(i = 0; i < ALARMS; i++){
+        if(alarm.pending & (1 << i)){
+            di();
+            alarm.pending &= ~(1 << i);
+            ei();
+            raise_irq(IRQ_REASON_UNDERVOLT + i);
+            break;
+        }
+    }
+}
+
 
 
 #ifdef BOOTAPP
 /*
 * Enter boot loader
 */
-static bool do_enterbootloader(uint8_t len, uint8_t *params)
+static bit do_enterbootloader(uint8_t len, volatile uint8_t *params)
 {
-	int i;
-	if((2 == len) && (0x55 == params[0]) && (0xAA == params[1])){
+	if((0x55 == params[0]) && (0xAA == params[1])){
 		enterbootloader=TRUE;
-		return PASS;
+		return NOERR;
 	}
-	return FAIL;
+	return ERR;
 }
 
 #endif
 
+/*
+ * No operation. Broadcast, it is BCP_ENUM and every node answers with an
+ * IRQ
+ */
+
+static bit do_noop(uint8_t len, volatile uint8_t *params)
+{
+    if(phd.bcast)
+        raise_irq(IRQ_REASON_NONE);
+    return NOERR;
+}
+
+/*
+ * Command table, indexed by command. Each entry gives the handler, the
+ * parameter lengths it accepts and how it may be addressed, so handlers
+ * only check their parameter values. GBAT is run by service_packets(),
+ * as XC8 cannot compile the recursion through dispatch()
+ */
+
+#define CMD_UNICAST     0x01    /* May be addressed to this node */
+#define CMD_BCAST       0x02    /* May be broadcast, no reply */
+#define CMD_SLOTTED     0x04    /* Broadcast, answered in our slot if it succeeds */
+#define CMD_INA226      0x08    /* Reads the INA226, fails until a snapshot is published */
+#define CMD_NOBATCH     0x10    /* Not allowed in GBAT */
+#define CMD_ANYLEN      0xFF    /* Length not checked */
+#define CMDS            (GCSX + 1)
+
+typedef struct {
+    bit (*handler)(uint8_t len, volatile uint8_t *params);
+    uint8_t len;                /* Accepted parameter lengths */
+    uint8_t altlen;
+    uint8_t flags;
+}cmd_t;
+
+#ifdef BOOTAPP
+#define CMD_GEBL {do_enterbootloader, 2, 2, CMD_UNICAST | CMD_NOBATCH}
+#else
+#define CMD_GEBL {0, 0, 0, CMD_NOBATCH}
+#endif
+
+static const cmd_t cmds[CMDS] = {
+    {do_noop, CMD_ANYLEN, 0, CMD_UNICAST | CMD_BCAST},          /* NOOP, BCP_ENUM */
+    {do_gnid, 4, 4, CMD_UNICAST},                               /* GNID */
+    {do_gcst, 3, 3, CMD_UNICAST},                               /* GCST */
+    {do_gipl, CMD_ANYLEN, 0, CMD_UNICAST},                      /* GIPL */
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},     /* 0x04 */
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},     /* 0x08 */
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},                   /* 0x0C */
+    CMD_GEBL,                                                   /* GEBL */
+    {0, 0, 0, 0}, {0, 0, 0, 0}, {0, 0, 0, 0},                   /* GVLV, GRLY, GTMP */
+    {do_gout, 3, 3, CMD_UNICAST},                               /* GOUT */
+    {0, 0, 0, 0}, {0, 0, 0, 0},                                 /* GINP, GACD */
+    {do_volts, 8, 8, CMD_UNICAST | CMD_INA226},                 /* GVLT */
+    {do_current, 8, 8, CMD_UNICAST | CMD_INA226},               /* GCUR */
+    {do_power, 8, 8, CMD_UNICAST | CMD_INA226},                 /* GPWR */
+    {do_shunt_config, 4, 4, CMD_UNICAST},                       /* GSCF */
+    {do_vip, 12, 12, CMD_UNICAST | CMD_INA226},                 /* GVIP */
+    {do_gbau, 2, 2, CMD_UNICAST | CMD_BCAST},                   /* GBAU */
+    {do_gacc, 11, 11, CMD_UNICAST | CMD_BCAST},                 /* GACC */
+    {do_gsta, 10, 10, CMD_UNICAST | CMD_BCAST},                 /* GSTA */
+    {do_galm, 5, 5, CMD_UNICAST},                               /* GALM */
+    {0, 0, 0, 0},                                               /* GPCY */
+    {do_ghis, 3, 4, CMD_UNICAST | CMD_NOBATCH},                 /* GHIS */
+    {0, 0, 0, CMD_NOBATCH},                                     /* GBAT */
+    {do_gsnp, 2, 13, CMD_UNICAST | CMD_BCAST | CMD_INA226},     /* GSNP */
+    {do_gslt, 4, 4, CMD_BCAST | CMD_SLOTTED | CMD_INA226},      /* GSLT */
+    {do_gadc, 4, 4, CMD_UNICAST},                               /* GADC */
+    {do_gdia, CMD_ANYLEN, 0, CMD_UNICAST},                      /* GDIA */
+    {do_gcsx, 25, 25, CMD_UNICAST}                              /* GCSX */
+};
+
+/*
+ * Run one command, addressed as mode (CMD_UNICAST or CMD_BCAST). Returns
+ * the handler's error flag, or ERR for an unknown command, a length the
+ * command does not take or one it cannot be addressed with
+ */
+
+static bit dispatch(uint8_t cmd, uint8_t len, volatile uint8_t *params,
+uint8_t mode)
+{
+    const cmd_t *c;
+
+    if(cmd >= CMDS)
+        return ERR;
+    c = &cmds[cmd];
+    if((!(c->flags & mode)) || ((CMD_ANYLEN != c->len) && (len != c->len) &&
+    (len != c->altlen)) || ((c->flags & CMD_INA226) && (!sampler.valid)))
+        return ERR;
+    return c->handler(len, params);
+}
+
+/*
+ * Run a batch of (cmd, len, params[len]) sub-records in order. Each reply
+ * overwrites its request, with GBAT_NAK set in the length byte if the
+ * command failed. The whole batch is checked before anything runs, so a
+ * malformed batch has no effect. Commands which change their reply length
+ * (GHIS) or restart the node (GEBL) are marked CMD_NOBATCH, as is GBAT
+ */
+
+static bit do_gbat(uint8_t len, volatile uint8_t *params)
+{
+    uint8_t i, n;
+
+    if(!len)
+        return ERR;
+    for(i = 0; i < len; i += n + 2){
+        if(len - i < 2)
+            return ERR;
+        n = params[i + 1];
+        if((n > len - i - 2) ||
+        ((params[i] < CMDS) && (cmds[params[i]].flags & CMD_NOBATCH)))
+            return ERR;
+    }
+    for(i = 0; i < len; i += n + 2){
+        n = params[i + 1];
+        if(dispatch(params[i], n, params + i + 2, CMD_UNICAST))
+            params[i + 1] |= GBAT_NAK;
+    }
+    return NOERR;
+}
+
+/*
+ * Foreground deframer. Drains the receive ring and assembles frames into
+ * the free frame buffer, so the next frame can be assembled while the
+ * previous one is being serviced. Bytes stay in the ring while both
+ * buffers are in use.
+ */
+
+static void deframe(void)
+{
+	frame_t *f;
+
+	// Packet time out
+	if((RXI_ASSEM == rxi.state) && (!rxi.packettimer)){
+		if(!rxi.skip)
+			comms.timeouts++;
+		rxi.state = RXI_INIT;
+	}
+
+	while(rxring.tail != rxring.head){
+		f = &frames[rxi.buf];
+		if(f->ready)
+			return; // No free buffer
+
+		rxi.c = rxring.buf[rxring.tail];
+		rxring.tail = (rxring.tail + 1) & (RXRINGSIZE - 1);
+
+		if(!rxi.sub){
+			if(STX == rxi.c)
+				rxi.state = RXI_INIT; // Start from beginning
+			else if(ETX == rxi.c){
+				if(RXI_ASSEM != rxi.state)
+					continue; // Stray, no frame to finish
+				rxi.state = RXI_FINISH; // Finish up
+			}
+			else if(SUBST == rxi.c){
+				rxi.sub = TRUE; // Next char is a substitution
+				continue;
+			}
+		}
+
+		switch(rxi.state){
+
+			case	RXI_INIT:
+				if(STX == rxi.c){
+					rxi.packettimer = baudrates[baud.rate].packettime;
+					rxi.state = RXI_ASSEM;
+					rxi.index = 0;
+					rxi.crc = 0;
+					rxi.skip = FALSE;
+				}
+				break;
+
+			case	RXI_ASSEM:
+				/*
+				 * Only requests are assembled. Replies from the other
+				 * nodes, slotted answers to a broadcast in particular,
+				 * are passed over up to their ETX so they never take
+				 * the free buffer while ours waits to go out
+				 */
+				if((0 == rxi.index) && (HDC != (rxi.c & ~HDCFLAGS)) &&
+				(HDC16 != (rxi.c & ~HDCFLAGS)))
+					rxi.skip = TRUE;
+				if(rxi.skip)
+					break;
+				if(rxi.index < MAXXPACKET){
+					((uint8_t *) &f->pkt)[rxi.index] = rxi.c;
+					/*
+					 * Fold in the byte which can no longer be
+					 * part of the trailing CRC
+					 */
+					if(HDC == (f->pkt.hcb & ~HDCFLAGS)){
+						if(rxi.index >= 1)
+							rxi.crc = crc8_update((uint8_t) rxi.crc,
+							((uint8_t *) &f->pkt)[rxi.index - 1]);
+					}
+					else if(HDC16 == (f->pkt.hcb & ~HDCFLAGS)){
+						if(rxi.index >= 2)
+							rxi.crc = crc16_update(rxi.crc,
+							((uint8_t *) &f->pkt)[rxi.index - 2]);
+					}
+				}
+				if(rxi.index < 0xFF) // Over length frames are rejected later
+					rxi.index++;
+				break;
+
+			case	RXI_FINISH:
+				rxi.state = RXI_INIT;
+				if(rxi.skip)
+					break;
+				f->len = rxi.index;
+				f->crc = rxi.crc;
+				f->ready = TRUE;
+				rxi.buf ^= 1; // Assemble the next frame in the other buffer
+				break;
+
+			default:
+				rxi.state = RXI_INIT;
+				break;
+		}
+		rxi.sub = FALSE;
+	}
+}
+
 /*
 * State machine to service packets
 */
 
 void service_packets(void)
 {
-	uint16_t crc16;
-	uint8_t i,crc,len;
+	uint16_t crc16, now, t;
+	uint32_t stay;
+	uint8_t i,len,hcb;
+	frame_t *f = &frames[phd.buf];	// Frame being serviced
+	xpkt_t *pkt = &f->pkt;
+
+	// Assemble any bytes received since the last pass
+	deframe();
 
 	// Packet Service
 	switch(phd.state){
 		case PHD_START:
-			if(rxi.pready){
+			if(baud.confirm && !baud.timer){
+				// Switch not confirmed, go back to the saved rate
+				baud.confirm = FALSE;
+				set_baud(eedata.baud);
+			}
+			if(f->ready){
 				phd.rxerr = 0;
+				phd.frame = TRUE;
                                 /* Handy u8 * reference */
-				phd.pktb = (uint8_t *) &pkt; 
+				phd.pktb = (uint8_t *) pkt; 
 				phd.state = PHD_PKT_READY;
 			}
 			else if((irq.flag) && (0 == irq.timer) &&
                         (!ADDRPROGMODE)){
                             /* This block sends an interrupt request */
                             uint8_t holdoff = irq.holdoff;
-                            /* Provide a pseudo random delay time. */
+                            /*
+                             * Provide a pseudo random delay time. Seeded
+                             * with the address, as crcreg would otherwise
+                             * equal holdoff and the CRC would collapse to 0
+                             */
+                            crcreg = myaddress;
                             irq.holdoff = calc_crc(&holdoff, 1); 
                             irq.timer = irq.holdoff & 0x1F;
-                            crcreg = 0;
                             phd.crcword = TRUE;
-                            pkt.hcb = HDCIRQ16;
-                            pkt.addr = myaddress;
-                            phd.pktb = (uint8_t *) &pkt;
+                            phd.frame = FALSE;
+                            irqpkt[0] = HDCIRQ16;
+                            irqpkt[1] = myaddress;
+                            phd.pktb = irqpkt;
                             txi.blen = PKTIRQLEN;
                             phd.state = PHD_TX_START;
 			}
@@ -824,38 +2248,54 @@ void service_packets(void)
 
 		case PHD_PKT_READY:
                         /* If wrong header */
-			if((pkt.hcb != HDC) && (pkt.hcb != HDC16)){ 
+			hcb = pkt->hcb & ~HDCFLAGS;
+			if((hcb != HDC) && (hcb != HDC16)){ 
                             phd.state = PHD_FIN;
                             break;
 			}
 
-			if(rxi.index >= MAXPACKET){ // If too long
+			if(f->len > ((pkt->hcb & HDCX) ? MAXXPACKET : MAXPACKET)){ // If too long
                             phd.state = PHD_FIN;
                             break;
 			}
 
-			if(HDC == pkt.hcb){ // 8 bit CRC
+                        /*
+                         * The CRC was folded in by deframe() as the
+                         * frame arrived, only the compare is left to do
+                         */
+			if(HDC == hcb){ // 8 bit CRC
                             phd.crcword = FALSE;
-                            crcreg = 0;
-                            crc = calc_crc(phd.pktb, rxi.index - 1);
-                            if(phd.pktb[rxi.index-1] != crc){ // If CRC error
-				phd.crcerrs++;
+                            if(f->len < PKTCTRL + 1){ // If too short
+                                phd.state = PHD_FIN;
+                                break;
+                            }
+                            if(phd.pktb[f->len-1] != (uint8_t) f->crc){ // If CRC error
+				comms.crcerrs++;
 				phd.state = PHD_FIN;
 				break;
                             }
 			}
 			else{ // 16 bit CRC
-                            uint16_t packetcrc = phd.pktb[rxi.index - 2] +
-                            (((uint16_t) phd.pktb[rxi.index - 1]) << 8);
                             phd.crcword = TRUE;
-                            crc16 = calc_crc16(0, phd.pktb, rxi.index - 2);
+                            if(f->len < PKTCTRL + 2){ // If too short
+                                phd.state = PHD_FIN;
+                                break;
+                            }
+                            crc16 = phd.pktb[f->len - 2] +
+                            (((uint16_t) phd.pktb[f->len - 1]) << 8);
 
-                            if(packetcrc != crc16){ // If CRC error
-                                phd.crcerrs++;
+                            if(crc16 != f->crc){ // If CRC error
+                                comms.crcerrs++;
 				phd.state = PHD_FIN;
 				break;
                             }
 			}
+			comms.frames++;
+			phd.pack = (pkt->hcb & HDCPK) ? TRUE : FALSE;
+			phd.packed = FALSE;
+			phd.slotted = FALSE;
+			// Response is the request length unless a handler changes it
+			phd.rlen = f->len - ((phd.crcword) ? (PKTCTRL + 2) : (PKTCTRL + 1));
 			phd.state = PHD_PKT_DECODE;
 			break;
 
@@ -863,14 +2303,14 @@ void service_packets(void)
 
 			if(!ADDRPROGMODE){
                             /* If not our address or broadcast address */
-                            if((pkt.addr != myaddress) && (pkt.addr != 0xFF)){ 
+                            if((pkt->addr != myaddress) && (pkt->addr != 0xFF)){ 
 				phd.state = PHD_FIN;
 				break; // Not for us
                             }
 			}
 			else{
-                            if(PADD == pkt.cmd){ // Program address
-				myaddress = pkt.addr;
+                            if(PADD == pkt->cmd){ // Program address
+				myaddress = pkt->addr;
 				eeprom_write(EEADDR, myaddress);
                             }
                             else{
@@ -881,7 +2321,7 @@ void service_packets(void)
 
 			if(!ADDRPROGMODE){
                             /* Compute parameter length */
-                            len = rxi.index - ((phd.crcword) ?
+                            len = f->len - ((phd.crcword) ?
                             (PKTCTRL + 2) : (PKTCTRL + 1)); 
                             #ifdef BOOTAPP
                             enterbootloader = FALSE;
@@ -889,65 +2329,22 @@ void service_packets(void)
 
                             // Decode command
 
-                            if(pkt.addr == myaddress){
-                                switch(pkt.cmd){
-                                    case NOOP: // No Operation
-					break;
-
-                                    case GNID: // Node ID
-                                        phd.rxerr = do_gnid(len, pkt.params);
-					break;
-
-                                    case GCST: // Comm Status
-                                        phd.rxerr = do_gcst(len, pkt.params);
-					break;
-
-                                    case GIPL: // Poll Interrupt reason
-                                        phd.rxerr =  do_gipl(len, pkt.params);
-                                        break;
-
-                                    case GOUT:
-                                        phd.rxerr = do_gout(len, pkt.params);
-                                        break;
-
-                                    case GVLT: // Return voltage
-                                        phd.rxerr = do_volts(len, pkt.params);
-                                        break;
-
-                                    case GCUR: // Return current
-                                        phd.rxerr = do_current(len, pkt.params);
-                                        break;
-
-                                    case GPWR: // Return power
-                                        phd.rxerr = do_power(len, pkt.params);
-                                        break;
-
-                                    case GSCF:
-                                        phd.rxerr = do_shunt_config(len, pkt.params);
-                                        break;
-
-                                    #ifdef BOOTAPP
-                                    case GEBL:	// Enter boot loader
-                                        phd.rxerr = do_enterbootloader(len,
-                                        pkt.params);
-                                        break;
-                                    #endif
-
-                                    default:
-                                        phd.rxerr = TRUE;
-				}
+                            phd.bcast = (pkt->addr != myaddress) ? TRUE : FALSE;
+                            if(!phd.bcast){
+                                if(GBAT == pkt->cmd) // Batch of commands
+                                    phd.rxerr = do_gbat(len, pkt->params);
+                                else
+                                    phd.rxerr = dispatch(pkt->cmd, len, pkt->params,
+                                    CMD_UNICAST);
                             }
                            else{ // Must be a broadcast packet
-                                switch(pkt.cmd){
-                                   case BCP_ENUM: // Enumerate
-                                        raise_irq(IRQ_REASON_NONE);
-                                        break;
-
-                                        default:
-                                            break;
-                                }
-                                phd.state = PHD_FIN;
-                                break; // Broadcast packets are not Ack'ed
+                                // BCP_ENUM, and latches or switches for every node together
+                                if((NOERR == dispatch(pkt->cmd, len, pkt->params,
+                                CMD_BCAST)) && (cmds[pkt->cmd].flags & CMD_SLOTTED))
+                                    phd.slotted = TRUE; // Answer in our own slot
+                                // Broadcast packets are not Ack'ed, unless slotted
+                                phd.state = (phd.slotted) ? PHD_PKT_RESP : PHD_FIN;
+                                break;
                             }
 			}
 			phd.state = PHD_PKT_RESP;
@@ -956,31 +2353,41 @@ void service_packets(void)
 		case PHD_PKT_RESP:
 
                     // Send Response;
+                    hcb = pkt->hcb & HDCX;
                     if(phd.rxerr)
-                        pkt.hcb = (phd.crcword) ? HDC_NAK16 : HDC_NAK;
+                        pkt->hcb = (phd.crcword) ? HDC_NAK16 : HDC_NAK;
                     else
-                        pkt.hcb = (phd.crcword) ? HDC_ACK16 : HDC_ACK;
+                        pkt->hcb = (phd.crcword) ? HDC_ACK16 : HDC_ACK;
 
                     phd.state = PHD_TX_START;
-                    txi.blen = rxi.index;
+                    txi.blen = PKTCTRL + phd.rlen + ((phd.crcword) ? 2 : 1);
+                    if(hcb || (txi.blen != f->len))
+                        pkt->hcb |= HDCX; // Extended, or not the request length
+                    if(phd.packed)
+                        pkt->hcb |= HDCPK;
+                    if(phd.slotted){ // Answer from our address, in our slot
+                        pkt->addr = myaddress;
+                        phd.state = PHD_WAIT_SLOT;
+                    }
+                    break;
+
+		case PHD_WAIT_SLOT:
+                    di();
+                    if(!slottimer)
+                        phd.state = PHD_TX_START;
+                    ei();
                     break;
 
 		case PHD_TX_START:
 
                     TXENA = TRUE;	// Enable TX
+                    txi.pktb = phd.pktb;
 
-                    //calculate return CRC
-
-                    if(!phd.crcword){ // 8 bit response CRC
-                        crcreg = 0;
-                        crc = calc_crc(phd.pktb,txi.blen - 1);
-			phd.pktb[txi.blen - 1] = crc;
-                    }
-                    else{ // 16 bit response CRC
-                        uint16_t pktcrc = calc_crc16(0, phd.pktb, txi.blen - 2);
-                        phd.pktb[txi.blen - 2] = (uint8_t) pktcrc;
-                        phd.pktb[txi.blen - 1] = pktcrc >> 8;
-                    }
+                    // Return CRC is generated by handle_tbe() on the fly
+                    txi.crcword = phd.crcword;
+                    txi.dlen = txi.blen - ((phd.crcword) ? 2 : 1);
+                    txi.crc = 0;
+                    txi.timed = (phd.frame && !phd.slotted) ? TRUE : FALSE;
 
                     // Send the response
                     phd.state = PHD_WAIT_TX;
@@ -1004,8 +2411,8 @@ void service_packets(void)
 
 		case PHD_FIN:
                     #ifdef BOOTAPP
-                    if(((HDC_ACK == pkt.hcb) || (HDC_ACK16 == pkt.hcb)) &&
-                    (GEBL == pkt.cmd) && enterbootloader){
+                    if(((HDC_ACK == pkt->hcb) || (HDC_ACK16 == pkt->hcb)) &&
+                    (GEBL == pkt->cmd) && enterbootloader){
                         for(i = 0 ; i < 3; i++){
                             write_eeprom(EEBOOTSIG, 0x55);
                             delay_ms(10);
@@ -1017,22 +2424,51 @@ void service_packets(void)
 			reset_cpu();
 			}
                     #endif
-                    rxi.pready = FALSE;
+                    if(baud.change){ // Response is out, switch rate
+                        baud.change = FALSE;
+                        if(baud.next != baud.rate){
+                            set_baud(baud.next);
+                            baud.timer = BAUD_CONFIRM;
+                            baud.confirm = TRUE;
+                        }
+                    }
+                    if(phd.frame){ // Release the frame buffer
+                        f->ready = FALSE;
+                        phd.buf ^= 1;
+                        phd.frame = FALSE;
+                    }
                     phd.state = PHD_START;
                     break;
 
 		default:
-                    rxi.pready = FALSE;
-                    phd.state = PHD_START;
+                    phd.state = PHD_FIN;
 		break;
 
 	} // end switch
 
+	// Time the state just left, in whole ticks once Timer1 may have wrapped
+	if(phd.state != diag.phstate){
+		TMR1_READ(now);
+		di();
+		t = diag.phticks;
+		diag.phticks = 0;
+		ei();
+		stay = (t >= 63) ? (uint32_t) t << 10 : (uint16_t) (now - diag.phstamp);
+		if(stay > diag.phase[diag.phstate])
+			diag.phase[diag.phstate] = stay;
+		diag.phstate = phd.state;
+		diag.phstamp = now;
+	}
 }
 
 
 
-int main(void) {
+/*
+ * Power up initialization
+ */
+
+void node_init(void)
+{
     uint8_t i;
 
     /*
@@ -1056,10 +2492,10 @@ int main(void) {
     WPUC = 0x00;
     PORTC = 0x00;
     
-    /* UART */
-    SPBRGL = SET_BAUD(9600);
+    /* UART, 16 bit baud rate generator. Rate is set once config is read */
+    BAUDCON = 0x08;
     RCSTA = 0x90;
-    TXSTA = 0x20;
+    TXSTA = 0x24;
 
     /* I2C */
     SSP1CON1 = 0x8;
@@ -1073,19 +2509,40 @@ int main(void) {
     /* Timer 0 */
     OPTION_REG = 0x04; /* 976.5625 Hz 1.024 mSec */
 
+    /* Timer 1, free running 1 uSec for the latency diagnostics */
+    T1CON = 0x31;
+
     myaddress = eeprom_read(EEADDR);
     if(0xFF == myaddress) // If EEPROM erased
         myaddress = 0x1F; // Use test address 0x1F
     /* Fetch config */
     eeprom_to_ram(&eedata, EECONFIGSTART, sizeof(eedata_t));
     if(eedata.sig != EESIG){
-        for(i = 2; i < sizeof(eedata_t); i++)
+        if(eedata.sig != EESIG_V1){ // Erased, start from the defaults
+            eedata.shunt_amps = DEF_SHUNT_AMPS;
+            eedata.shunt_mv = DEF_SHUNT_MV;
+            eedata.baud = 0;
+        }
+        // The original firmware never wrote past its shunt and rate
+        for(i = EEV1_LEN; i < sizeof(eedata_t); i++)
             eedata.bytes[i] = 0;
         eedata.sig = EESIG;
-        eedata.shunt_amps = DEF_SHUNT_AMPS;
-        eedata.shunt_mv = DEF_SHUNT_MV;
         ram_to_eeprom(EECONFIGSTART, &eedata, sizeof(eedata_t));
     }
+    if(eedata.baud >= BAUD_RATES)
+        eedata.baud = 0;
+    stats.window = eedata.stat_window;
+    for(i = 0; i < ALARMS; i++)
+        alarm.limit[i] = eedata.alarm_limit[i];
+    hist.period = eedata.hist_period & ~HIST_SPILL;
+    hist.spill = (eedata.hist_period & HIST_SPILL) ? TRUE : FALSE;
+    /* Address programming always runs at 9600 */
+    set_baud((ADDRPROGMODE) ? 0 : eedata.baud);
+
+    #if defined(IDLE_SLEEP) && !defined(SIMULATOR)
+    /* SLEEP enters Idle, peripherals keep their clock */
+    CPUDOZEbits.IDLEN = TRUE;
+    #endif
 
     /* Interrupt enables */
     PIE1bits.SSP1IE = TRUE;
@@ -1096,8 +2553,12 @@ int main(void) {
     calc_ina226_cal();
     
     /* Set up INA226 */
-    INA226_TRANS_WAIT(INA226_CONFIG, 0, INA226_INIT_CONFIG);
+    INA226_TRANS_WAIT(INA226_CONFIG, 0, ina226_config());
     INA226_TRANS_WAIT(INA226_CAL, 0, ina226_cal);
+    alarm_program();
+
+    /* Start background sampling */
+    sampler.run = TRUE;
  
 
 
@@ -1107,15 +2568,120 @@ int main(void) {
     raise_irq(IRQ_REASON_ATBOOT);
 
     ledactivitytimer = 0x3F; // Short flash to indicate start up
-   
+}
+
+/*
+ * Foreground tasks. Each runs to completion when node_poll() sees one of
+ * its events, and posts an event if it leaves work behind
+ */
+
+/*
+ * Protocol task. The packet handler runs until its state settles. Waiting
+ * for the transmitter to empty is polled, TRMT raises no interrupt
+ */
+
+static void pkt_task(void)
+{
+    uint8_t state;
+
+    do{
+        state = phd.state;
+        service_packets();
+    } while(phd.state != state);
+    if(PHD_WAIT_EMPTY == phd.state)
+        POST(EV_PKT);
+}
+
+/*
+ * Save the config block, then any history spill, a byte at a time with
+ * one write in flight. Bytes which are already correct are skipped, as in
+ * ram_to_eeprom(). A spill is written from the end, so its sequence number
+ * goes last and GHIS never takes a part written record for a whole one
+ */
+
+static void ee_task(void)
+{
+    uint8_t *b = (uint8_t *) &eespill.rec;
+
+    while((eecursor < sizeof(eedata_t)) || eespill.left){
+        if(EECON1bits.WR)
+            return; // Write in progress, try again next tick
+        if(eecursor < sizeof(eedata_t)){
+            if(eeprom_read(EECONFIGSTART + eecursor) != eedata.bytes[eecursor])
+                eeprom_write(EECONFIGSTART + eecursor, eedata.bytes[eecursor]);
+            eecursor++;
+        }
+        else{
+            eespill.left--;
+            if(eeprom_read(eespill.addr + eespill.left) != b[eespill.left])
+                eeprom_write(eespill.addr + eespill.left, b[eespill.left]);
+        }
+    }
+}
+
+/*
+ * LED activity timer
+ */
+
+static void led_task(void)
+{
+    if(ledactivitytimer){
+        ledactivitytimer--;
+        if(ledactivitytimer)
+            LED = 0;
+        else
+            LED = 1;
+    }
+}
+
+/*
+ * One pass of the foreground loop. Takes the events posted since the last
+ * pass and runs their tasks. With IDLE_SLEEP the core sleeps when there
+ * are none. An interrupt which posts one after the check wakes SLEEP at
+ * once, as GIE is clear, and is taken at ei()
+ */
+
+void node_poll(void)
+{
+    uint8_t ev;
+
+    CLRWDT();
+    di();
+    ev = events;
+    events = 0;
+    #ifdef IDLE_SLEEP
+    if(!ev)
+        SLEEP();
+    #endif
+    ei();
+    if(ev & (EV_RX | EV_TXDONE | EV_PKT | EV_TICK))
+        pkt_task();
+    if(ev & EV_ALARM)
+        alarm_poll();
+    if(ev & EV_HIST)
+        hist_poll();
+    if(ev & EV_FOLD)
+        acc_fold();
+    if(ev & (EV_EESAVE | EV_TICK))
+        ee_task();
+    if(ev & EV_TICK)
+        led_task();
+}
+
+
+#ifndef SIMULATOR
+int main(void) {
+
+    node_init();
+
     /*
      * Foreground loop
      */
 
     while (1) {
-        CLRWDT();
-        service_packets();
+        node_poll();
 
     }
     return 0;
 }
+#endif
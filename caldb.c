@@ -1,48 +1,208 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <string.h>
+#include <math.h>
+#include "inacal.h"
 
 /*
- * Test bench to calculate INA226 calibration value
+ * Test bench to calculate INA226 calibration values
+ *
+ * Uses the calibration math in inacal.h, as the firmware does. Given a
+ * shunt it prints the values a node will use. With -s it sweeps every
+ * legal shunt (1-200 A, 1-80 mV) and reports the worst case gain error
+ * against exact arithmetic, any shunt where the calibration does not fit
+ * its register, and how the LSB's and calibration compare with the
+ * original 32 bit divide path. With -t it prints the whole table as CSV,
+ * for fleet configuration, and with -g the inacal_cal table.
+ *
+ * Build: cc -O2 -o caldb caldb.c -lm
+ * Usage: caldb amps mv | caldb -s | caldb -t | caldb -g
  */
 
+#define SHUNT_LSB	2.5e-6			// Shunt voltage register LSB, volts
 
-main(int argc, char *argv[])
+typedef struct {
+	uint16_t amps;
+	uint8_t mv;
+	inacal_t c;
+	inacal_t ref;				// Original divide path
+	double exact;				// Exact calibration
+	double gain;				// Reported over true current
+	double refgain;
+	int overflow;				// Calibration does not fit its register
+} check_t;
+
+/*
+ * Original calibration, three 32 bit divides
+ */
+
+static void ref_calc(inacal_t *c, uint16_t amps, uint8_t mv)
 {
-	uint32_t a107, rs107,power_lsb,current_lsb;
+	uint32_t a107, rs107;
+
+	a107 = 10000000 * (uint32_t) amps;
+	rs107 = (mv * (10000000 / 1000)) / amps;
+
+	c->current_lsb = a107 >> 15;
+	c->power_lsb = 25 * c->current_lsb;
+	c->cal = (uint16_t) ((512000000) / ((c->current_lsb * rs107) / 1000));
+}
+
+/*
+ * Current register = shunt register x cal / 2048, scaled by the current
+ * LSB. Ideally that equals the true current
+ */
+
+static double gain(const inacal_t *c, uint16_t amps, uint8_t mv)
+{
+	double rshunt = mv / 1000.0 / amps;
+
+	return rshunt * c->cal * c->current_lsb * 1e-7 / (SHUNT_LSB * 2048);
+}
+
+/*
+ * Run both paths for one shunt and check them
+ */
+
+static void check(check_t *k, uint16_t amps, uint8_t mv)
+{
+	k->amps = amps;
+	k->mv = mv;
+	inacal_calc(&k->c, amps, mv);
+	ref_calc(&k->ref, amps, mv);
+	k->exact = 0.00512 * 32768 * 1000 / mv;
+	k->overflow = k->exact > INACAL_CAL_MAX + 0.5;
+	k->gain = gain(&k->c, amps, mv);
+	k->refgain = gain(&k->ref, amps, mv);
+}
+
+static void sweep(void)
+{
+	check_t k, worst, refworst;
+	unsigned amps, mv, overflows = 0, lsbdiff = 0, caldiff = 0, n = 0;
+	unsigned mvmin = INACAL_MV_MAX + 1, calstep = 0, d;
+	double worsterr = 0, refworsterr = 0;
+
+	memset(&worst, 0, sizeof(worst));
+	memset(&refworst, 0, sizeof(refworst));
+	for(amps = 1; amps <= INACAL_AMPS_MAX; amps++){
+		for(mv = 1; mv <= INACAL_MV_MAX; mv++){
+			check(&k, (uint16_t) amps, (uint8_t) mv);
+			n++;
+			if((k.c.current_lsb != k.ref.current_lsb) ||
+			(k.c.power_lsb != k.ref.power_lsb))
+				lsbdiff++;
+			if(k.overflow){
+				overflows++;
+				continue;
+			}
+			if(mv < mvmin)
+				mvmin = mv;
+			if(k.c.cal != k.ref.cal){
+				caldiff++;
+				d = abs((int) k.c.cal - (int) k.ref.cal);
+				if(d > calstep)
+					calstep = d;
+			}
+			if(fabs(k.gain - 1) > worsterr){
+				worsterr = fabs(k.gain - 1);
+				worst = k;
+			}
+			if(fabs(k.refgain - 1) > refworsterr){
+				refworsterr = fabs(k.refgain - 1);
+				refworst = k;
+			}
+		}
+	}
+	printf("%u shunts checked\n", n);
+	printf("Calibration over 0x%04X: %u (usable from %u mV)\n",
+	INACAL_CAL_MAX, overflows, mvmin);
+	printf("LSB's differing from the divide path: %u\n", lsbdiff);
+	printf("Calibrations differing from the divide path: %u, by up to %u\n",
+	caldiff, calstep);
+	printf("Worst gain error: %.0f ppm at %u A %u mV (cal 0x%04X, current lsb %u)\n",
+	worsterr * 1e6, worst.amps, worst.mv, worst.c.cal,
+	worst.c.current_lsb);
+	printf("Divide path:      %.0f ppm at %u A %u mV (cal 0x%04X)\n",
+	refworsterr * 1e6, refworst.amps, refworst.mv, refworst.ref.cal);
+}
+
+/*
+ * Print the inacal_cal table
+ */
+
+static void gen(void)
+{
+	unsigned mv;
+	long cal;
+
+	for(mv = 1; mv <= INACAL_MV_MAX; mv++){
+		cal = lround(0.00512 * 32768 * 1000 / mv);
+		if(cal > INACAL_CAL_MAX)
+			cal = INACAL_CAL_MAX;
+		printf("%s%ld%s", (mv % 8 == 1) ? "\t" : "", cal,
+		(mv == INACAL_MV_MAX) ? "\n" : (mv % 8) ? ", " : ",\n");
+	}
+}
+
+static void table(void)
+{
+	check_t k;
+	unsigned amps, mv;
+
+	printf("amps,mv,cal,current_lsb,power_lsb,gain_err_ppm,overflow\n");
+	for(amps = 1; amps <= INACAL_AMPS_MAX; amps++){
+		for(mv = 1; mv <= INACAL_MV_MAX; mv++){
+			check(&k, (uint16_t) amps, (uint8_t) mv);
+			printf("%u,%u,%u,%u,%u,%.0f,%d\n", amps, mv, k.c.cal,
+			k.c.current_lsb, k.c.power_lsb, (k.gain - 1) * 1e6,
+			k.overflow);
+		}
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	check_t k;
 	uint8_t shunt_mv;
-	uint16_t shunt_amps,ina226_cal;
-	
-	
+	uint16_t shunt_amps;
+
+	if((2 == argc) && !strcmp(argv[1], "-s")){
+		sweep();
+		exit(0);
+	}
+	if((2 == argc) && !strcmp(argv[1], "-t")){
+		table();
+		exit(0);
+	}
+	if((2 == argc) && !strcmp(argv[1], "-g")){
+		gen();
+		exit(0);
+	}
 	if(argc != 3){
-		printf("Usage: caldb amps mv\n");
+		printf("Usage: caldb amps mv | caldb -s | caldb -t | caldb -g\n");
 		exit(1);
 	}
-	
+
 	shunt_mv = (uint8_t) atoi(argv[2]);
 	shunt_amps = (uint16_t) atoi(argv[1]);
-	
+	if(!shunt_amps || shunt_amps > INACAL_AMPS_MAX || !shunt_mv ||
+	shunt_mv > INACAL_MV_MAX){
+		printf("Shunt must be 1-%u A, 1-%u mV\n", INACAL_AMPS_MAX,
+		INACAL_MV_MAX);
+		exit(1);
+	}
+
 	printf("shunt_mv   = 0x%02X\n", shunt_mv);
 	printf("shunt_amps = 0x%04X\n", shunt_amps);
-	
-	
-	
-
-    a107 = 10000000 * shunt_amps;
-    rs107 = (shunt_mv*(10000000/1000))/shunt_amps;
-    
-	printf("a107   = %u\n", a107);
-	printf("rs107 = %u\n", rs107);  
-
-    current_lsb = a107 >> 15;
-    power_lsb = 25 * current_lsb;
-    
-    
-    printf("power_lsb   = %u\n", power_lsb);
-	printf("current_lsb = %u\n", current_lsb);  
-  
-    
-    ina226_cal = (uint16_t) ((512000000)/((current_lsb * rs107 )/1000));
-	printf("Cal value: %X\n", ina226_cal);
+
+	check(&k, shunt_amps, shunt_mv);
+	printf("power_lsb   = %u\n", k.c.power_lsb);
+	printf("current_lsb = %u\n", k.c.current_lsb);
+	printf("Cal value: %X\n", k.c.cal);
+	printf("Gain error: %.0f ppm\n", (k.gain - 1) * 1e6);
+	if(k.overflow)
+		printf("Calibration overflows, exact value %.0f\n", k.exact);
 	exit(0);
 }
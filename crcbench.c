@@ -0,0 +1,212 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "han.h"
+#include "hancrc.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_TSC 1
+#endif
+
+/*
+ * Test bench for the nibble table CRC kernels in hancrc.h
+ *
+ * Checks the table kernels against the original bit serial routines
+ * from batterymon.c, then reports the cost per byte of each. The host
+ * timings only rank the kernels against each other; the PIC cost is
+ * the instruction cycle count below.
+ *
+ * Build: cc -O2 -o crcbench crcbench.c
+ * Usage: crcbench [iterations]
+ */
+
+#define BUFLEN MAXPACKET
+
+/*
+ * PIC16F1 cost per byte in instruction cycles (Fosc/4, 8 per uSec at
+ * 32 MHz), counted from enhanced mid-range sequences for each kernel.
+ * The data byte comes in through MOVIW FSR1++ and the loop over the
+ * packet is DECFSZ/BRA (3 cycles). Tables are read through FSR0 with
+ * FSR0H set once before the loop; a MOVIW from program memory takes 2
+ * cycles. XC8 free mode adds bank selects and temporaries to all four.
+ *
+ * crc8 bit serial, per bit, 11 cycles either way (10 on the last):
+ *	movf bits,w / xorwf crc,w / lsrf crc,f / andlw 1 / movlw 0x8C /
+ *	btfss STATUS,Z / xorwf crc,f / lsrf bits,f / decfsz j,f / bra
+ *	byte: 2 fetch + 2 counter + 87 + 3 loop = 94
+ * crc8 nibble table, per nibble, 11 cycles:
+ *	movf crc,w / andlw 0x0F / addlw tab / movwf FSR0L / moviw 0[FSR0] /
+ *	movwf t / swapf crc,w / andlw 0x0F / xorwf t,w / movwf crc
+ *	byte: 2 fetch and xor + 22 + 3 loop = 27
+ * crc16 bit serial, per bit, 11 cycles when the top bit is set, 8 when
+ * clear (9.5 mean, 1 less on the last):
+ *	lslf crcl,f / rlf crch,f / btfss STATUS,C / bra / movlw 0x21 /
+ *	xorwf crcl,f / movlw 0x10 / xorwf crch,f / decfsz j,f / bra
+ *	byte: 2 fetch + 2 counter + 75 + 3 loop = 82
+ * crc16 nibble table, per nibble, 23 cycles:
+ *	index: swapf crch,w / andlw 0x0F / lslf WREG,w / addlw tab / movwf FSR0L
+ *	entry: moviw 0[FSR0] / movwf tl / moviw 1[FSR0] / movwf th
+ *	shift and fold: 12 swapf/andlw/iorwf/xorwf/movwf
+ *	byte: 2 fetch and xor + 46 + 3 loop = 51
+ */
+
+#define PIC_REF8    94
+#define PIC_TAB8    27
+#define PIC_REF16   82
+#define PIC_TAB16   51
+
+/*
+ * Original bit serial 8 bit CRC
+ */
+
+static uint8_t ref_crc8(uint8_t crcreg, const uint8_t *p, uint8_t len)
+{
+	uint8_t theBits, fb;
+	uint8_t i, j;
+
+	for(i = 0 ; i < len ; i++){
+		theBits = *p++;
+		for(j = 0 ; j < 8 ; j++){
+			fb = (theBits ^ crcreg) & 1;
+			crcreg >>= 1;
+			if(fb)
+				crcreg ^= POLY;
+			theBits >>= 1;
+		}
+	}
+	return crcreg;
+}
+
+/*
+ * Original bit serial 16 bit CRC
+ */
+
+static uint16_t ref_crc16(uint16_t crc, const uint8_t *buf, uint8_t len)
+{
+	uint8_t i, j, dogen;
+
+	for(i = 0; i < len; i++){
+		crc ^= ((uint16_t) buf[i]) << 8;
+		for(j = 0; j < 8; j++){
+			dogen = ((crc & 0x8000) != 0);
+			crc <<= 1;
+			if(dogen)
+				crc ^= POLY16;
+		}
+	}
+	return crc;
+}
+
+static uint8_t tab_crc8(uint8_t crc, const uint8_t *p, uint8_t len)
+{
+	while(len--)
+		crc = crc8_update(crc, *p++);
+	return crc;
+}
+
+static uint16_t tab_crc16(uint16_t crc, const uint8_t *p, uint8_t len)
+{
+	while(len--)
+		crc = crc16_update(crc, *p++);
+	return crc;
+}
+
+/*
+ * Time stamp in CPU cycles if available, else nanoseconds
+ */
+
+static uint64_t stamp(void)
+{
+#ifdef HAVE_TSC
+	return __rdtsc();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+#endif
+}
+
+static volatile uint16_t sink;
+
+int main(int argc, char *argv[])
+{
+	uint8_t buf[BUFLEN];
+	unsigned long iters = 1000000, i, errors = 0;
+	unsigned int len, n;
+	uint64_t t0, t_ref8, t_tab8, t_ref16, t_tab16;
+	double bytes;
+
+	if(argc > 2){
+		printf("Usage: crcbench [iterations]\n");
+		exit(1);
+	}
+	if(argc == 2)
+		iters = strtoul(argv[1], NULL, 0);
+
+	/* Exhaustive single byte check from every starting state */
+	for(n = 0; n < 65536; n++){
+		uint8_t c = (uint8_t) n;
+		if(ref_crc8((uint8_t) (n >> 8), &c, 1) != crc8_update((uint8_t) (n >> 8), c))
+			errors++;
+	}
+	for(n = 0; n < 0x1000000; n++){
+		uint8_t c = (uint8_t) n;
+		if(ref_crc16((uint16_t) (n >> 8), &c, 1) != crc16_update((uint16_t) (n >> 8), c))
+			errors++;
+	}
+
+	/* Random packets of every legal length */
+	srand(1);
+	for(i = 0; i < 100000; i++){
+		len = 1 + (i % BUFLEN);
+		for(n = 0; n < len; n++)
+			buf[n] = (uint8_t) rand();
+		if(ref_crc8(0, buf, len) != tab_crc8(0, buf, len))
+			errors++;
+		if(ref_crc16(0, buf, len) != tab_crc16(0, buf, len))
+			errors++;
+	}
+
+	printf("Compare: %s (%lu mismatches)\n", errors ? "FAIL" : "PASS", errors);
+
+	/* Timing over full size packets */
+	for(n = 0; n < BUFLEN; n++)
+		buf[n] = (uint8_t) rand();
+	bytes = (double) iters * BUFLEN;
+
+	t0 = stamp();
+	for(i = 0; i < iters; i++)
+		sink = ref_crc8((uint8_t) i, buf, BUFLEN);
+	t_ref8 = stamp() - t0;
+
+	t0 = stamp();
+	for(i = 0; i < iters; i++)
+		sink = tab_crc8((uint8_t) i, buf, BUFLEN);
+	t_tab8 = stamp() - t0;
+
+	t0 = stamp();
+	for(i = 0; i < iters; i++)
+		sink = ref_crc16((uint16_t) i, buf, BUFLEN);
+	t_ref16 = stamp() - t0;
+
+	t0 = stamp();
+	for(i = 0; i < iters; i++)
+		sink = tab_crc16((uint16_t) i, buf, BUFLEN);
+	t_tab16 = stamp() - t0;
+
+#ifdef HAVE_TSC
+	printf("Per byte: host TSC cycles (relative only), PIC16F1 instruction cycles (counted)\n");
+#else
+	printf("Per byte: host nanoseconds (relative only), PIC16F1 instruction cycles (counted)\n");
+#endif
+	printf("                      host    PIC\n");
+	printf("crc8  bit serial: %8.2f %6d\n", t_ref8 / bytes, PIC_REF8);
+	printf("crc8  nibble tab: %8.2f %6d\n", t_tab8 / bytes, PIC_TAB8);
+	printf("crc16 bit serial: %8.2f %6d\n", t_ref16 / bytes, PIC_REF16);
+	printf("crc16 nibble tab: %8.2f %6d\n", t_tab16 / bytes, PIC_TAB16);
+
+	exit(errors ? 1 : 0);
+}
@@ -0,0 +1,35 @@
+/*
+* hal.h
+*
+* Hardware abstraction seam for batterymon.c
+*
+* On target the firmware is built against the XC8 device header. When
+* SIMULATOR is defined it is built for the host against sim.h, which
+* models the SFR's, EEPROM and compiler intrinsics the firmware uses.
+*
+* IDLE_SLEEP (-DIDLE_SLEEP) makes the foreground sleep when it has
+* nothing to do. It needs a part with an Idle mode (CPUDOZE IDLEN), where
+* peripherals keep running. On the PIC16F1825 SLEEP stops Timer0, the
+* MSSP and the EUSART and the PLL takes 2 mSec to relock, so it is left
+* off there and a target build for a part without IDLEN refuses it. The
+* simulator models Idle, and like the target builds without it unless
+* asked.
+*/
+
+#ifndef HAL
+#define HAL
+
+#ifdef SIMULATOR
+#include "sim.h"
+#else
+#include <xc.h>
+#if defined(IDLE_SLEEP) && !defined(_CPUDOZE_IDLEN_POSN)
+#error "IDLE_SLEEP needs a part with Idle mode (CPUDOZE IDLEN), this one would stop its peripherals in SLEEP"
+#endif
+#endif
+
+// Foreground entry points, main() on target, the simulator on the host
+void node_init(void);
+void node_poll(void);
+
+#endif
@@ -15,7 +15,9 @@
 #define PKTIRQLEN	4				// Length of an IRQ packet
 #define PKTCTRL		3				// Number of packet control bytes 
 
-#define MAXPACKET	PKTCTRL + MAXPARAMS		// Max packet size excluding byte stuffing and STX/ETX
+#define MAXPACKET	(PKTCTRL + MAXPARAMS)		// Max packet size excluding byte stuffing and STX/ETX
+#define MAXXPARAMS	64				// Maximum parameter bytes in an extended (HDCX) frame, inclusive of CRC
+#define MAXXPACKET	(PKTCTRL + MAXXPARAMS)		// Max extended packet size
 
 #define STX		0x02				// Denotes start of frame
 #define ETX		0x03				// Denotes end of frame
@@ -24,6 +26,9 @@
 #define	HDCIRQ		0x02				// Header control bits for interrupt request
 #define HDCIRQ16	0x03				// Header control bits for interrupt request with 16 bit CRC
 #define HDC16		0x05				// Header control bits for 16 bit CRC and 8 bit address
+#define HDCX		0x08				// Header flag: extended frame, up to MAXXPARAMS parameter bytes
+#define HDCPK		0x10				// Header flag: packed reply wanted (request) or sent (response)
+#define HDCFLAGS	(HDCX | HDCPK)			// All header flags
 #define	HDC_ACK		0xC1				// ACK response
 #define HDC_NAK 	0x81				// NAK response
 #define	HDC_ACK16 	0xC5				// ACK response CRC16
@@ -35,7 +40,7 @@
 // Common state machine constants
 enum {RXI_INIT = 0, RXI_ASSEM, RXI_FINISH};
 enum {TXI_INIT=0, TXI_TXC, TXI_TXC_POSTSUB, TXI_FIN};
-enum {PHD_START= 0, PHD_PKT_READY, PHD_PKT_DECODE, PHD_PKT_RESP, PHD_TX_START, PHD_WAIT_TX, PHD_WAIT_EMPTY, PHD_FIN};
+enum {PHD_START= 0, PHD_PKT_READY, PHD_PKT_DECODE, PHD_PKT_RESP, PHD_WAIT_SLOT, PHD_TX_START, PHD_WAIT_TX, PHD_WAIT_EMPTY, PHD_FIN, PHD_STATES};
 
 
 /*
@@ -46,7 +51,7 @@ enum {PHD_START= 0, PHD_PKT_READY, PHD_PKT_DECODE, PHD_PKT_RESP, PHD_TX_START, P
 
 #define NOOP	0				// No Operation
 #define	GNID	1				// Return node ID information
-#define GCST	2				// Return communications status
+#define GCST	2				// Return communications status (action, crcerrs, timeouts) legacy 8 bit view, the low bytes of the GCSX counters which are authoritative, action 1 resets both GCSX counters
 #define	GIPL	3				// Poll for interrupt reason
 #define GEBL	0x0F				// Enter boot loader
 
@@ -62,6 +67,29 @@ enum {PHD_START= 0, PHD_PKT_READY, PHD_PKT_DECODE, PHD_PKT_RESP, PHD_TX_START, P
 #define GCUR    0x17                            // Return current (channel, current[2], magnitude, 1lsb[4])
 #define GPWR    0x18                            // Return power (channel, power[2], magnitude, 1lsb[4])
 #define GSCF    0x19                            // Rwad/Write Shunt configuration
+#define GVIP    0x1A                            // Return voltage, current and power from one conversion
+                                                // (channel, magnitude, volt[2], current[2], power[2], 1lsb[4])
+                                                // volt lsb as GVLT, 1lsb is the current lsb, power lsb is 25 * 1lsb
+#define GBAU    0x1B                            // Baud rate (rate, action) rate: 0 9600, 1 38400, 2 115200, 3 250000 action: 0 read, 1 switch, 2 confirm
+#define GACC    0x1C                            // Charge and energy (action, selector, magnitude, value[8]) action: bit 0 latch, bit 1 reset, a broadcast must latch selector: 0 charge, 1 energy, 2 ticks
+#define GSTA    0x1D                            // Statistics (action, quantity, min[2], max[2], mean[2], count[2]) action: 0 read, 1 read and reset, 2 read last window, 3 set window, a broadcast only 1 or 3 quantity: 0 volts, 1 current, 2 power
+                                                // count saturates at 65535: min and max keep following every sample, mean is that of the first 65535
+#define GALM    0x1E                            // Alarm limits (action, alarm, limit[2], active) action: 0 read, 1 write alarm: 0 under voltage, 1 over current, 2 over power
+#define GHIS    0x20                            // Sample history (action, cursor[2], count | period[2]) action: 0 read page, 1 set period, 2 read period
+#define GBAT    0x21                            // Batch of sub-records (cmd, len, params[len])..., replies in place
+#define GBAT_NAK 0x80                           // Set in a sub-record length byte if that command failed
+#define GSNP    0x22                            // Latched snapshot (action, tag, magnitude, volt[2], current[2], power[2], 1lsb[4]) action: 0 read, 1 latch and read
+                                                // Latch only with (1, tag), usually broadcast so every node latches together
+#define GSLT    0x23                            // Slotted broadcast read (tag, base, count, slot) slot: 1.024 mSec ticks, 0 rate default
+                                                // Nodes base to base + count - 1 latch as GSNP and answer the GSNP read in slot (addr - base)
+#define GADC    0x24                            // INA226 profile (action, avg, vbusct, vshct) action: 0 read, 1 write, fields as the INA226 config register codes, a write converting in under 4 mSec is NAK'ed
+#define GDIA    0x25                            // Latency diagnostics (action, block, ...) action: 0 read, 1 read and reset, block: 0 turnaround, 1 INA226, 2 isr() per handler, 3 packet handler states, times in uSec
+                                                // block 0 turnaround, 1 INA226 transaction: (min[2], max[2], mean[2], count[2], bins[8][2]), bin n under 32 << n
+                                                // count and each bin saturate at 65535, min and max keep following every time, mean is that of the first 65535
+                                                // block 2: (isrmax[2], isrcount[4], {max[2], sum[4], count[4]}[5]) handlers rda, tmr0, i2c, int, tbe, sum and count stop before sum wraps
+                                                // block 3: (phase[9][4]) longest stay in each packet handler state
+#define GCSX    0x26                            // Extended comm status (action, crcerrs[4], timeouts[4], overruns[4], framing[4], dropped[4], frames[4])
+                                                // action: 0 read, 1 read and reset
 #define GPCY	0x1F				// Return power cycle status (state) state: 0, power cycle, nz, power cycle
 
 // Broadcast commands
@@ -78,6 +106,9 @@ enum {PHD_START= 0, PHD_PKT_READY, PHD_PKT_DECODE, PHD_PKT_RESP, PHD_TX_START, P
 #define IRQ_REASON_ATBOOT 1			// IRQ at BOOT
 #define IRQ_REASON_ACFAIL 2			// AC Failure during operation
 #define IRQ_REASON_ACREST 3			// AC restored
+#define IRQ_REASON_UNDERVOLT 4			// Bus voltage fell below the limit
+#define IRQ_REASON_OVERCURRENT 5		// Current rose above the limit
+#define IRQ_REASON_OVERPOWER 6			// Power rose above the limit
 
 
 // Misc Constants
@@ -98,41 +129,60 @@ typedef struct {
 	uint8_t	params[MAXPARAMS];		// Parameters and CRC
 } pkt_t;
 
+// Extended packet structure
+typedef struct {
+	uint8_t	hcb;				// Header control
+	uint8_t	addr;				// Dest addr
+	uint8_t	cmd;				// Command
+	uint8_t	params[MAXXPARAMS];		// Parameters and CRC
+} xpkt_t;
+
 // Han Packet State machine
 typedef struct {
         struct{
             unsigned rxerr : 1;			// Error flag
             unsigned crcword : 1;		// True if 16 bit CRC's to be used
+            unsigned frame : 1;			// True if servicing a received frame
+            unsigned pack : 1;			// True if the request asked for a packed reply
+            unsigned packed : 1;		// True if the handler packed its reply
+            unsigned slotted : 1;		// True if answering a broadcast in our slot
+            unsigned bcast : 1;			// True if servicing a broadcast
         };
 	uint8_t	*pktb;				// Buffer pointer
+	uint8_t	buf;				// Frame buffer being serviced
+	uint8_t	rlen;				// Response parameter length
 	uint8_t	state;				// Packet State
-        uint8_t crcerrs;                        // CRC errors
-        uint8_t packettimeouts;                 // Packet timeouts
-
 } phd_t;
 
 
-// Receive data structure
+// Receive deframer structure
 typedef struct {
 	uint8_t	c;				// Last char received
 	uint8_t	packettimer;			// Packet time out timer
 	uint8_t	state;				// State
 	uint8_t	index;				// Buffer index
+	uint8_t	buf;				// Frame buffer being assembled
+	uint16_t crc;				// CRC of the bytes received so far
         struct{
             unsigned sub : 1;			// Substitute flag
-            unsigned pready : 1;		// Packet Ready
+            unsigned skip : 1;			// Frame is not a request, pass over it
         };
 } rxi_t;
 
 
 // Transmit data structure
 typedef struct {
+	uint8_t	*pktb;				// Buffer pointer
 	uint8_t	state;				// TX State
 	uint8_t	index;				// Buffer index
 	uint8_t	blen;				// Buffer length to transmit
+	uint8_t	dlen;				// Length excluding CRC
 	uint8_t	tchar;
+	uint16_t crc;				// CRC of the bytes sent so far
         struct{
             unsigned txbusy : 1;                // Busy flag
+            unsigned crcword : 1;		// True if 16 bit CRC to be sent
+            unsigned timed : 1;			// True if the reply turnaround is to be timed
         };
 } txi_t;
 
@@ -0,0 +1,182 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include "han.h"
+#include "hanmaster.h"
+
+/*
+ * HAN bus master benchmark
+ *
+ * Queues a run of identical polls to one node through hanmaster.c, answers
+ * any interrupt requests with GIPL, and reports completed polls per second
+ * and the median and 99th percentile turnaround (request written to first
+ * response byte) and exchange (request written to response complete) times.
+ * Run it against a real node, or against batsim -p.
+ *
+ * Build: cc -O2 -o hanbench hanbench.c hanmaster.c
+ * Usage: hanbench [-n count] [-a addr] [-c cmd] [-l plen] [-b baud] [-8] device
+ */
+
+typedef struct {
+	unsigned ok, nak, timeout, bad;
+	double *turn;
+	double *exch;
+} results_t;
+
+static han_req_t gipl;
+static int gipl_busy;
+
+static void poll_done(han_req_t *req, void *ctx)
+{
+	results_t *r = ctx;
+	struct timespec t;
+
+	switch(req->status){
+		case HAN_OK:
+			clock_gettime(CLOCK_MONOTONIC, &t);
+			r->turn[r->ok] = han_elapsed_us(&req->sent, &req->answered);
+			r->exch[r->ok] = han_elapsed_us(&req->sent, &t);
+			r->ok++;
+			break;
+		case HAN_NAK:
+			r->nak++;
+			break;
+		case HAN_TIMEOUT:
+			r->timeout++;
+			break;
+		default:
+			r->bad++;
+			break;
+	}
+}
+
+static void gipl_done(han_req_t *req, void *ctx)
+{
+	gipl_busy = 0;
+}
+
+/*
+ * Acknowledge an interrupt request so the node stops repeating it
+ */
+
+static void irq(uint8_t addr, void *ctx)
+{
+	han_master_t *m = ctx;
+
+	if(gipl_busy)
+		return;
+	gipl_busy = 1;
+	memset(&gipl, 0, sizeof(gipl));
+	gipl.addr = addr;
+	gipl.cmd = GIPL;
+	gipl.crc16 = 1;
+	gipl.plen = 1;
+	gipl.done = gipl_done;
+	han_submit(m, &gipl);
+}
+
+static int cmp(const void *a, const void *b)
+{
+	double x = *(const double *) a, y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+static double pct(double *v, unsigned n, unsigned p)
+{
+	return n ? v[(n - 1) * p / 100] : 0;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned count = 1000, baud = 9600, plen = 0, i;
+	int opt, crc16 = 1;
+	uint8_t addr = 0x1F, cmd = NOOP;
+	han_master_t *m;
+	han_req_t *reqs;
+	results_t r;
+	struct timespec start, end;
+	double secs;
+
+	while((opt = getopt(argc, argv, "n:a:c:l:b:8")) != -1){
+		switch(opt){
+			case 'n':
+				count = atoi(optarg);
+				break;
+			case 'a':
+				addr = (uint8_t) strtoul(optarg, NULL, 0);
+				break;
+			case 'c':
+				cmd = (uint8_t) strtoul(optarg, NULL, 0);
+				break;
+			case 'l':
+				plen = atoi(optarg);
+				break;
+			case 'b':
+				baud = atoi(optarg);
+				break;
+			case '8':
+				crc16 = 0;
+				break;
+			default:
+				optind = argc;
+				break;
+		}
+	}
+	if(optind != argc - 1 || !count || plen > MAXPARAMS - 2){
+		printf("Usage: hanbench [-n count] [-a addr] [-c cmd] [-l plen] [-b baud] [-8] device\n");
+		exit(1);
+	}
+	if(!(m = han_open(argv[optind], baud))){
+		perror(argv[optind]);
+		exit(1);
+	}
+	han_set_irq(m, irq, m);
+
+	reqs = calloc(count, sizeof(*reqs));
+	memset(&r, 0, sizeof(r));
+	r.turn = calloc(count, sizeof(double));
+	r.exch = calloc(count, sizeof(double));
+	if(!reqs || !r.turn || !r.exch){
+		printf("Out of memory\n");
+		exit(1);
+	}
+
+	// Let a freshly started node send its boot IRQ, and answer it
+	do
+		han_poll(m, 500);
+	while(han_pending(m));
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	for(i = 0; i < count; i++){
+		reqs[i].addr = addr;
+		reqs[i].cmd = cmd;
+		reqs[i].crc16 = (uint8_t) crc16;
+		reqs[i].plen = (uint8_t) plen;
+		reqs[i].done = poll_done;
+		reqs[i].ctx = &r;
+		han_submit(m, &reqs[i]);
+	}
+	while(han_pending(m))
+		if(han_poll(m, 1000) < 0){
+			perror("han_poll");
+			exit(1);
+		}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	secs = han_elapsed_us(&start, &end) / 1e6;
+
+	qsort(r.turn, r.ok, sizeof(double), cmp);
+	qsort(r.exch, r.ok, sizeof(double), cmp);
+	printf("%u polls of node 0x%02X cmd 0x%02X at %u baud, %s CRC\n", count,
+	addr, cmd, baud, crc16 ? "16 bit" : "8 bit");
+	printf("ok %u nak %u timeout %u bad %u in %.3f s, %.1f polls/s\n", r.ok,
+	r.nak, r.timeout, r.bad, secs, r.ok / secs);
+	printf("turnaround p50 %.0f us p99 %.0f us\n", pct(r.turn, r.ok, 50),
+	pct(r.turn, r.ok, 99));
+	printf("exchange   p50 %.0f us p99 %.0f us\n", pct(r.exch, r.ok, 50),
+	pct(r.exch, r.ok, 99));
+
+	han_close(m);
+	exit(r.ok == count ? 0 : 2);
+}
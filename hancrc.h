@@ -0,0 +1,52 @@
+/*
+* hancrc.h
+*
+* Nibble table CRC kernels for the HAN protocol. Shared by the firmware
+* and the host tools. Include <stdint.h> and han.h first.
+*
+* The tables are const so XC8 places them in program flash (16 bytes for
+* CRC8, 32 bytes for CRC16). Each byte costs two table lookups instead of
+* eight shift/test/xor iterations.
+*/
+
+#ifndef HANCRC
+#define HANCRC
+
+// CRC8, POLY (0x8C) reflected, processed LSB first
+static const uint8_t crc8_nibble[16] = {
+	0x00, 0x9D, 0x23, 0xBE, 0x46, 0xDB, 0x65, 0xF8,
+	0x8C, 0x11, 0xAF, 0x32, 0xCA, 0x57, 0xE9, 0x74
+};
+
+// CRC16, POLY16 (0x1021) processed MSB first
+static const uint16_t crc16_nibble[16] = {
+	0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50A5, 0x60C6, 0x70E7,
+	0x8108, 0x9129, 0xA14A, 0xB16B, 0xC18C, 0xD1AD, 0xE1CE, 0xF1EF
+};
+
+
+/*
+* Fold one byte into an 8 bit CRC
+*/
+
+static uint8_t crc8_update(uint8_t crc, uint8_t c)
+{
+	crc ^= c;
+	crc = (crc >> 4) ^ crc8_nibble[crc & 0x0F];
+	crc = (crc >> 4) ^ crc8_nibble[crc & 0x0F];
+	return crc;
+}
+
+/*
+* Fold one byte into a 16 bit CRC
+*/
+
+static uint16_t crc16_update(uint16_t crc, uint8_t c)
+{
+	crc ^= ((uint16_t) c) << 8;
+	crc = (crc << 4) ^ crc16_nibble[crc >> 12];
+	crc = (crc << 4) ^ crc16_nibble[crc >> 12];
+	return crc;
+}
+
+#endif
@@ -0,0 +1,866 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include "hal.h"
+#include "han.h"
+#include "hancrc.h"
+#include "hanmaster.h"
+
+/*
+ * Protocol conformance and throughput fuzzer
+ *
+ * Boots batterymon.c on the simulated PIC (sim.c) and feeds it random and
+ * adversarial byte streams through the real receive interrupt and packet
+ * handler: requests with random parameters (exercising SUBST) and either
+ * CRC width, flipped bits, truncated frames, stray STX and ETX, garbage
+ * between frames, frames over MAXPACKET and MAXXPACKET, bad headers,
+ * frames for another node and frames which stall past the packet timer.
+ *
+ * Each stream is also fed to a reference model of the receiver written
+ * from han.h, which gives the answers the node should send: none, ACK or
+ * NAK, with the request's CRC width, address and command, and for NOOP
+ * and NAK's the request's parameters. Answers are deframed and CRC checked
+ * with hanmaster.c. After the run the node's GCSX counters are checked
+ * against the model's.
+ *
+ * GCST is checked to read the low bytes of GCSX past 255 CRC errors. A
+ * slotted broadcast is then answered by other nodes around this one,
+ * whose answers must be passed over without counting as errors.
+ *
+ * The throughput run then streams back to back frames for another node at
+ * each rate and reports the frames the node processed per simulated
+ * second and any lost. Built with -DIDLE_SLEEP it also reports the core
+ * duty cycle and the core time per frame, without it (as shipped) the
+ * core never sleeps.
+ *
+ * Build: cc -O2 -DSIMULATOR -o hanfuzz hanfuzz.c sim.c batterymon.c hanmaster.c
+ * Usage: hanfuzz [-n cases] [-s seed] [-b rate] [-v]
+ *        rate: 0 9600, 1 38400, 2 115200, 3 250000
+ * Exits non zero on any mismatch.
+ */
+
+#define NODEADDR	0x1F			// Address of a node with erased EEPROM
+#define OTHERADDR	0x20			// Some other node
+#define QUIET_MS	3			// Bus quiet time which ends a case
+#define GAP_MS		300			// Pause which outlasts any packet timer
+#define MAXSTREAM	1024
+#define MAXGOT		4			// Answers kept per case
+#define BURST		2000			// Throughput frames per rate
+#define SLOTNODES	6			// Nodes answering the slotted broadcast
+#define SLOTOURS	4			// Slot of the node under test
+
+static const unsigned bauds[] = {9600, 38400, 115200, 250000};
+static const unsigned packettime[] = {0xFF, 64, 22, 10}; // As the firmware's
+static const unsigned slots[] = {42, 12, 6, 4};
+
+// Case kinds
+enum {K_VALID = 0, K_BADCRC, K_TRUNC, K_TIMEOUT, K_STX, K_ETX, K_GARBAGE,
+K_OVERSIZE, K_BADHDR, K_OTHER, K_KINDS};
+
+static const char *const kindnames[K_KINDS] = {"valid", "badcrc", "trunc",
+"timeout", "stx", "etx", "garbage", "oversize", "badhdr", "other"};
+
+// Relative frequency of each kind
+static const unsigned weights[K_KINDS] = {30, 10, 10, 2, 8, 5, 8, 8, 5, 5};
+
+// Read commands, answered in place when the length is right
+static const struct {
+	uint8_t cmd, len;
+} reads[] = {{GNID, 4}, {GCST, 3}, {GVIP, 12}, {GSCF, 4}, {GADC, 4}};
+
+#define READS	(sizeof(reads) / sizeof(reads[0]))
+
+typedef struct {
+	uint8_t hcb;
+	uint8_t cmd;
+	unsigned len;				// Frame length, unstuffed
+	int echo;				// Parameters are the request's
+	uint8_t params[MAXXPARAMS];
+	unsigned plen;
+} expect_t;
+
+// Receiver reference model
+static struct {
+	int inframe, sub;
+	unsigned len;
+	uint8_t buf[MAXXPACKET + 1];
+	expect_t exp[MAXGOT];
+	unsigned nexp;
+	int unknown;				// An answer the model cannot predict
+	unsigned long crcerrs, timeouts, frames;
+} ref;
+
+// Answers from the node
+static struct {
+	han_deframer_t df;
+	uint8_t buf[MAXGOT][MAXXPACKET + 1];
+	unsigned len[MAXGOT];
+	unsigned n;
+	uint64_t last;				// Cycle of the last byte sent
+} got;
+
+static unsigned long irqframes;
+static int verbose;
+static uint32_t seed = 1;
+
+/*
+ * xorshift32, so a seed gives the same run everywhere
+ */
+
+static uint32_t rnd(void)
+{
+	seed ^= seed << 13;
+	seed ^= seed >> 17;
+	seed ^= seed << 5;
+	return seed;
+}
+
+static unsigned below(unsigned n)
+{
+	return rnd() % n;
+}
+
+/*
+ * Parameter byte, often one which has to be stuffed
+ */
+
+static uint8_t param(void)
+{
+	return (uint8_t) (below(3) ? rnd() : below(SUBST + 1));
+}
+
+/*
+ * Command the node has no unicast handler for
+ */
+
+static int is_unknown(uint8_t cmd)
+{
+	return (cmd >= 0x04 && cmd <= 0x12) || cmd == 0x14 || cmd == 0x15 ||
+	cmd == GPCY || cmd == GSLT || cmd > GCSX;
+}
+
+static uint8_t unknown_cmd(void)
+{
+	uint8_t cmd;
+
+	do
+		cmd = (uint8_t) rnd();
+	while(!is_unknown(cmd));
+	return cmd;
+}
+
+/*
+ * Build an unstuffed frame with its CRC, return its length
+ */
+
+static unsigned raw_frame(uint8_t *raw, int crc16, uint8_t hcb, uint8_t addr,
+uint8_t cmd, const uint8_t *params, unsigned plen)
+{
+	unsigned n = 0, i;
+	uint16_t crc = 0;
+
+	raw[n++] = hcb;
+	raw[n++] = addr;
+	raw[n++] = cmd;
+	memcpy(raw + n, params, plen);
+	n += plen;
+	for(i = 0; i < n; i++)
+		crc = crc16 ? crc16_update(crc, raw[i]) :
+		crc8_update((uint8_t) crc, raw[i]);
+	raw[n++] = (uint8_t) crc;
+	if(crc16)
+		raw[n++] = (uint8_t) (crc >> 8);
+	return n;
+}
+
+/*
+ * Stuff a frame between STX and ETX, return its length
+ */
+
+static unsigned stuff(uint8_t *out, const uint8_t *raw, unsigned n)
+{
+	unsigned i, o = 0;
+
+	out[o++] = STX;
+	for(i = 0; i < n; i++){
+		if(raw[i] <= SUBST)
+			out[o++] = SUBST;
+		out[o++] = raw[i];
+	}
+	out[o++] = ETX;
+	return o;
+}
+
+/*
+ * A request the node should answer, unstuffed
+ */
+
+static unsigned request(uint8_t *raw, uint8_t addr)
+{
+	uint8_t params[MAXXPARAMS], hcb, cmd;
+	int crc16 = below(2);
+	unsigned plen, max, i, r;
+
+	hcb = crc16 ? HDC16 : HDC;
+	if(!below(4))
+		hcb |= HDCX;
+	if(!below(8))
+		hcb |= HDCPK;
+	max = ((hcb & HDCX) ? MAXXPARAMS : MAXPARAMS) - (crc16 ? 2 : 1);
+	switch(below(3)){
+		case 0:
+			cmd = NOOP;
+			plen = below(max + 1);
+			break;
+
+		case 1:
+			cmd = unknown_cmd();
+			plen = below(max + 1);
+			break;
+
+		default:
+			r = below(READS);
+			cmd = reads[r].cmd;
+			plen = below(4) ? reads[r].len : below(max + 1);
+			if(plen == reads[r].len){
+				memset(params, 0, plen); // Action 0, read
+				return raw_frame(raw, crc16, hcb, addr, cmd, params, plen);
+			}
+			break;
+	}
+	for(i = 0; i < plen; i++)
+		params[i] = param();
+	return raw_frame(raw, crc16, hcb, addr, cmd, params, plen);
+}
+
+/*
+ * Build a case, return the stream length. *gap is set to the bytes to send
+ * before pausing past the packet timer, or 0
+ */
+
+static unsigned gen_case(uint8_t *s, unsigned *gap, int kind, unsigned maxframe)
+{
+	uint8_t raw[MAXSTREAM], params[MAXSTREAM];
+	unsigned n = 0, len, i, at, plen, max;
+	int crc16;
+	uint8_t hcb;
+
+	*gap = 0;
+	switch(kind){
+		case K_BADCRC:
+			len = request(raw, NODEADDR);
+			raw[below(len)] ^= (uint8_t) (1 << below(8));
+			return stuff(s, raw, len);
+
+		case K_TRUNC:
+		case K_TIMEOUT:
+			len = stuff(s, raw, request(raw, NODEADDR));
+			n = 1 + below(len - 2); // STX and part of the rest, never ETX
+			if(K_TIMEOUT == kind)
+				*gap = n;
+			break;
+
+		case K_STX:
+			len = stuff(s, raw, request(raw, NODEADDR));
+			at = 1 + below(len - 1);
+			memmove(s + at + 1, s + at, len - at);
+			s[at] = STX;
+			return len + 1;
+
+		case K_ETX:
+			s[n++] = ETX;
+			if(below(2))
+				s[n++] = ETX;
+			break;
+
+		case K_GARBAGE:
+			for(i = below(32) + 1; i; i--){
+				do
+					s[n] = (uint8_t) rnd();
+				while(STX == s[n]);
+				n++;
+			}
+			break;
+
+		case K_OVERSIZE:
+			crc16 = below(2);
+			hcb = (crc16 ? HDC16 : HDC) | (below(2) ? HDCX : 0);
+			max = ((hcb & HDCX) ? MAXXPARAMS : MAXPARAMS) - (crc16 ? 2 : 1);
+			// Over the limit, but in by the packet timer
+			plen = max + 1 + below(max);
+			if(2 * (plen + PKTCTRL + 2) + 2 > maxframe)
+				plen = (maxframe - 2) / 2 - PKTCTRL - 2;
+			for(i = 0; i < plen; i++)
+				params[i] = param();
+			return stuff(s, raw, raw_frame(raw, crc16, hcb, NODEADDR, NOOP,
+			params, plen));
+
+		case K_BADHDR:
+			do
+				hcb = (uint8_t) rnd();
+			while((HDC == (hcb & ~HDCFLAGS)) || (HDC16 == (hcb & ~HDCFLAGS)));
+			plen = below(MAXPARAMS - 1);
+			for(i = 0; i < plen; i++)
+				params[i] = param();
+			return stuff(s, raw, raw_frame(raw, below(2), hcb, NODEADDR, NOOP,
+			params, plen));
+
+		case K_OTHER:
+			return stuff(s, raw, request(raw, OTHERADDR));
+
+		default:
+			break;
+	}
+	// Kinds which lead into a request
+	return n + stuff(s + n, raw, request(raw, NODEADDR));
+}
+
+/*
+ * Reference model: work out what the node should make of a frame
+ */
+
+static void ref_frame(void)
+{
+	expect_t *e;
+	uint8_t *b = ref.buf, hcb;
+	unsigned crcb, i, plen;
+	uint16_t crc = 0;
+	int ack = 1;
+
+	if(!ref.len)
+		return;
+	hcb = b[0] & ~HDCFLAGS;
+	if((hcb != HDC) && (hcb != HDC16))
+		return; // Not a request
+	if(ref.len > (unsigned) ((b[0] & HDCX) ? MAXXPACKET : MAXPACKET))
+		return; // Too long
+	crcb = (HDC16 == hcb) ? 2 : 1;
+	if(ref.len < PKTCTRL + crcb)
+		return; // Too short
+	for(i = 0; i < ref.len - crcb; i++)
+		crc = (2 == crcb) ? crc16_update(crc, b[i]) :
+		crc8_update((uint8_t) crc, b[i]);
+	if((2 == crcb) ? ((b[i] | (b[i + 1] << 8)) != crc) : (b[i] != crc)){
+		ref.crcerrs++;
+		return;
+	}
+	ref.frames++;
+	if(NODEADDR != b[1]){
+		if(0xFF == b[1])
+			ref.unknown = 1; // Broadcasts are not modeled
+		return;
+	}
+	plen = ref.len - PKTCTRL - crcb;
+	if(NOOP == b[2])
+		ack = 1;
+	else if(is_unknown(b[2]))
+		ack = 0;
+	else{
+		for(i = 0; i < READS && reads[i].cmd != b[2]; i++)
+			;
+		if(READS == i){
+			ref.unknown = 1;
+			return;
+		}
+		ack = (plen == reads[i].len);
+	}
+	if(ref.nexp >= MAXGOT)
+		return;
+	e = &ref.exp[ref.nexp++];
+	if(ack)
+		e->hcb = (2 == crcb) ? HDC_ACK16 : HDC_ACK;
+	else
+		e->hcb = (2 == crcb) ? HDC_NAK16 : HDC_NAK;
+	e->hcb |= b[0] & HDCX;
+	e->cmd = b[2];
+	e->len = ref.len;
+	e->echo = (NOOP == b[2]) || !ack;
+	e->plen = plen;
+	memcpy(e->params, b + PKTCTRL, plen);
+}
+
+static void ref_byte(uint8_t c)
+{
+	if(!ref.inframe){
+		// Outside a frame only STX means anything
+		if(STX == c){
+			ref.inframe = 1;
+			ref.sub = 0;
+			ref.len = 0;
+		}
+		return;
+	}
+	if(!ref.sub){
+		if(STX == c){
+			ref.len = 0;
+			return;
+		}
+		if(ETX == c){
+			ref.inframe = 0;
+			ref_frame();
+			return;
+		}
+		if(SUBST == c){
+			ref.sub = 1;
+			return;
+		}
+	}
+	ref.sub = 0;
+	if(ref.len < sizeof(ref.buf))
+		ref.buf[ref.len] = c;
+	ref.len++;
+}
+
+static void ref_gap(void)
+{
+	if(ref.inframe)
+		ref.timeouts++;
+	ref.inframe = 0;
+	ref.sub = 0;
+}
+
+/*
+ * Node side
+ */
+
+static void txhook(uint8_t c)
+{
+	got.last = sim_stats.cycles;
+	if(!han_deframe(&got.df, c))
+		return;
+	if((HDCIRQ == got.df.buf[0]) || (HDCIRQ16 == got.df.buf[0])){
+		irqframes++;
+		return;
+	}
+	if(got.n < MAXGOT){
+		memcpy(got.buf[got.n], got.df.buf, got.df.len);
+		got.len[got.n] = got.df.len;
+	}
+	got.n++;
+}
+
+/*
+ * Host side byte time, which paces the stream
+ */
+
+static uint64_t bytetime(void)
+{
+	return 10 * (uint64_t) (sim_hostbittime ? sim_hostbittime :
+	sim_uart_bittime());
+}
+
+/*
+ * Run the node until the stream is in, at cycle end, and the bus has been
+ * quiet a while
+ */
+
+static void settle(uint64_t end)
+{
+	uint64_t quiet = (uint64_t) SIM_MIPS * QUIET_MS / 1000 + 4 * bytetime();
+
+	got.last = end;
+	while((sim_stats.cycles < end) || (sim_stats.cycles - got.last < quiet))
+		node_poll();
+}
+
+static void send(const uint8_t *s, unsigned len, unsigned gap)
+{
+	memset(&got, 0, sizeof(got));
+	if(gap){
+		sim_uart_send(s, gap);
+		sim_run((uint64_t) gap * bytetime() + (uint64_t) SIM_MIPS * GAP_MS /
+		1000);
+		s += gap;
+		len -= gap;
+	}
+	sim_uart_send(s, len);
+	settle(sim_stats.cycles + (len + 1) * bytetime());
+}
+
+/*
+ * Send a request outside the fuzzing, return its answer or NULL
+ */
+
+static const uint8_t *command(uint8_t cmd, const uint8_t *params, unsigned plen)
+{
+	uint8_t raw[MAXXPACKET + 2], s[2 * MAXXPACKET + 4];
+	uint8_t hcb = HDC16 | ((plen > MAXPARAMS - 2) ? HDCX : 0);
+
+	send(s, stuff(s, raw, raw_frame(raw, 1, hcb, NODEADDR, cmd, params, plen)),
+	0);
+	if((1 != got.n) || !han_check(got.buf[0], got.len[0]) ||
+	((got.buf[0][0] & ~HDCFLAGS) != HDC_ACK16))
+		return NULL;
+	return got.buf[0];
+}
+
+static uint32_t counter(const uint8_t *b, unsigned i)
+{
+	b += PKTCTRL + 1 + 4 * i;
+	return b[0] | (b[1] << 8) | ((uint32_t) b[2] << 16) | ((uint32_t) b[3] << 24);
+}
+
+/*
+ * Read the GCSX counters, optionally resetting them
+ */
+
+static int read_comms(uint32_t *c, uint8_t reset)
+{
+	uint8_t params[25] = {0};
+	const uint8_t *b;
+	unsigned i;
+
+	params[0] = reset;
+	if(!(b = command(GCSX, params, sizeof(params))))
+		return 0;
+	for(i = 0; i < 6; i++)
+		c[i] = counter(b, i);
+	return 1;
+}
+
+static int switch_baud(unsigned rate)
+{
+	uint8_t params[2];
+
+	params[0] = (uint8_t) rate;
+	params[1] = 1;
+	if(!command(GBAU, params, 2))
+		return 0;
+	sim_run(SIM_MIPS / 1000);
+	sim_hostbittime = SIM_MIPS / bauds[rate];
+	params[1] = 2;
+	return command(GBAU, params, 2) != NULL;
+}
+
+#ifdef IDLE_SLEEP
+static double us(uint64_t cycles)
+{
+	return cycles * 1e6 / SIM_MIPS;
+}
+#endif
+
+static void dump(const char *what, const uint8_t *b, unsigned len)
+{
+	unsigned i;
+
+	printf("  %s:", what);
+	for(i = 0; i < len; i++)
+		printf(" %02X", b[i]);
+	printf("\n");
+}
+
+/*
+ * Compare the node's answers with the model's, return 0 on a mismatch
+ */
+
+static int check(void)
+{
+	expect_t *e;
+	uint8_t *b;
+	unsigned i;
+
+	if(got.n != ref.nexp)
+		return 0;
+	for(i = 0; i < got.n; i++){
+		e = &ref.exp[i];
+		b = got.buf[i];
+		if(!han_check(b, got.len[i]) || (b[0] != e->hcb) ||
+		(b[1] != NODEADDR) || (b[2] != e->cmd) || (got.len[i] != e->len))
+			return 0;
+		if(e->echo && memcmp(b + PKTCTRL, e->params, e->plen))
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Conformance run
+ */
+
+static int fuzz(unsigned cases, unsigned rate)
+{
+	static const char *const names[] = {"crcerrs", "timeouts", "overruns",
+	"framing", "dropped", "frames"};
+	uint8_t s[MAXSTREAM];
+	unsigned long runs[K_KINDS] = {0}, bad[K_KINDS] = {0}, answers = 0,
+	skipped = 0, fails = 0;
+	uint32_t c[6], want[6];
+	unsigned i, k, w, total = 0, len, gap, maxframe;
+
+	maxframe = (unsigned) ((packettime[rate] - 2) * 1024ULL * bauds[rate] /
+	10 / 1000000);
+	if(maxframe > MAXSTREAM / 2)
+		maxframe = MAXSTREAM / 2;
+	for(k = 0; k < K_KINDS; k++)
+		total += weights[k];
+	if(!read_comms(c, 1)){
+		printf("GCSX failed\n");
+		return 0;
+	}
+	memset(&ref, 0, sizeof(ref));
+	for(i = 0; i < cases; i++){
+		for(w = below(total), k = 0; w >= weights[k]; k++)
+			w -= weights[k];
+		len = gen_case(s, &gap, k, maxframe);
+		ref.nexp = 0;
+		ref.unknown = 0;
+		for(w = 0; w < len; w++){
+			if(gap && (w == gap))
+				ref_gap();
+			ref_byte(s[w]);
+		}
+		send(s, len, gap);
+		runs[k]++;
+		answers += got.n;
+		if(ref.unknown){
+			skipped++;
+			continue;
+		}
+		if(check())
+			continue;
+		bad[k]++;
+		if(fails++ < 10 || verbose){
+			printf("Case %u (%s): expected %u answers, got %u\n", i,
+			kindnames[k], ref.nexp, got.n);
+			dump("sent", s, len);
+			for(w = 0; w < got.n && w < MAXGOT; w++)
+				dump("got", got.buf[w], got.len[w]);
+		}
+	}
+
+	printf("%-9s %8s %8s\n", "kind", "cases", "failed");
+	for(k = 0; k < K_KINDS; k++)
+		printf("%-9s %8lu %8lu\n", kindnames[k], runs[k], bad[k]);
+	printf("%u cases at %u baud, %lu answers, %lu unmodeled, %lu IRQ frames\n",
+	cases, bauds[rate], answers, skipped, irqframes);
+
+	if(!read_comms(c, 0)){
+		printf("GCSX failed\n");
+		return 0;
+	}
+	memset(want, 0, sizeof(want));
+	want[0] = ref.crcerrs;
+	want[1] = ref.timeouts;
+	want[5] = ref.frames + 1; // The GCSX read itself
+	for(i = 0; i < 6; i++){
+		printf("%s %lu (model %lu)%s", names[i], (unsigned long) c[i],
+		(unsigned long) want[i], (i < 5) ? ", " : "\n");
+		if(c[i] != want[i])
+			fails++;
+	}
+	return !fails;
+}
+
+/*
+ * GCST run: CRC errors past 255, then GCST must still read the low bytes
+ * of the GCSX counters
+ */
+
+static int gcst_wrap(void)
+{
+	uint8_t raw[MAXPACKET + 2], s[MAXSTREAM], params[3] = {0}, gcst[2];
+	const uint8_t *b;
+	uint32_t c[6];
+	unsigned i, n = 0, len;
+	int ok;
+
+	if(!read_comms(c, 1)){
+		printf("GCSX failed\n");
+		return 0;
+	}
+	for(i = 0; i < 300; i++){
+		len = raw_frame(raw, 0, HDC, NODEADDR, NOOP, NULL, 0);
+		raw[len - 1] ^= 0x80;
+		if(n + 2 * len + 2 > sizeof(s)){
+			send(s, n, 0);
+			n = 0;
+		}
+		n += stuff(s + n, raw, len);
+	}
+	send(s, n, 0);
+	if(!(b = command(GCST, params, 3))){
+		printf("GCST failed\n");
+		return 0;
+	}
+	memcpy(gcst, b + PKTCTRL + 1, 2);
+	if(!read_comms(c, 0)){
+		printf("GCSX failed\n");
+		return 0;
+	}
+	ok = (c[0] > 0xFF) && (gcst[0] == (uint8_t) c[0]) &&
+	(gcst[1] == (uint8_t) c[1]);
+	printf("\nGCST: crcerrs %u timeouts %u, GCSX %lu %lu%s\n", gcst[0], gcst[1],
+	(unsigned long) c[0], (unsigned long) c[1], ok ? "" : " FAILED");
+	return ok;
+}
+
+/*
+ * Slotted run: a GSLT broadcast to SLOTNODES nodes, this one in slot
+ * SLOTOURS. The others answer in their own slots around it, more bytes
+ * than the receive ring holds before it, and their answers must not show
+ * up in the node's counters or hold up its own answer
+ */
+
+static int slotted(unsigned rate)
+{
+	uint8_t raw[MAXPACKET + 2], s[2 * MAXPACKET + 2], params[MAXPARAMS];
+	uint64_t start, slot;
+	uint32_t c[6];
+	unsigned k, i, n;
+	int ok;
+
+	if(!read_comms(c, 1)){
+		printf("GCSX failed\n");
+		return 0;
+	}
+	params[0] = 0x5A; // Tag
+	params[1] = NODEADDR - SLOTOURS; // Base
+	params[2] = SLOTNODES; // Count
+	params[3] = 0; // Default slot
+	n = stuff(s, raw, raw_frame(raw, 1, HDC16, 0xFF, GSLT, params, 4));
+	memset(&got, 0, sizeof(got));
+	sim_uart_send(s, n);
+	start = sim_stats.cycles + n * bytetime();
+	slot = (uint64_t) slots[rate] * SIM_MIPS * 1024 / 1000000;
+	for(k = 0; k < SLOTNODES; k++){
+		if(SLOTOURS == k)
+			continue; // Ours
+		// Into the slot by a tick, as a node on another clock would be
+		sim_run(start + k * slot + slot / slots[rate] - sim_stats.cycles);
+		for(i = 0; i < 13; i++)
+			params[i] = param();
+		sim_uart_send(s, stuff(s, raw, raw_frame(raw, 1, HDC_ACK16 | HDCX,
+		(uint8_t) (NODEADDR - SLOTOURS + k), GSLT, params, 13)));
+	}
+	settle(sim_stats.cycles + (2 * MAXPACKET + 2) * bytetime());
+	ok = (1 == got.n) && han_check(got.buf[0], got.len[0]) &&
+	((got.buf[0][0] & ~HDCFLAGS) == HDC_ACK16) && (NODEADDR == got.buf[0][1]) &&
+	(GSLT == got.buf[0][2]) && (0x5A == got.buf[0][PKTCTRL + 1]);
+	if(!read_comms(c, 0)){
+		printf("GCSX failed\n");
+		return 0;
+	}
+	for(i = 0; i < 5; i++)
+		if(c[i])
+			ok = 0;
+	if(c[5] != 2) // GSLT and the GCSX read
+		ok = 0;
+	printf("\nslotted: %u answers, crcerrs %lu, timeouts %lu, dropped %lu, "
+	"frames %lu%s\n", got.n, (unsigned long) c[0], (unsigned long) c[1],
+	(unsigned long) c[4], (unsigned long) c[5], ok ? "" : " FAILED");
+	return ok;
+}
+
+/*
+ * Throughput run: back to back frames for another node
+ */
+
+static int throughput(void)
+{
+	uint8_t raw[MAXPACKET + 2], params[MAXPARAMS], s[2 * MAXPACKET + 2];
+	uint8_t burst[MAXSTREAM * 2];
+	uint32_t c[6];
+	unsigned rate, i, j, n, plen, sent;
+	uint64_t start, bytes, wire;
+#ifdef IDLE_SLEEP
+	uint64_t idle;
+#endif
+	double secs;
+	int ok = 1;
+
+	printf("\n%-7s %6s %6s %10s %10s", "baud", "sent", "lost", "frames/s",
+	"bytes/s");
+#ifdef IDLE_SLEEP
+	printf(" %8s %9s", "duty(%)", "busy(us)");
+#endif
+	printf("\n");
+	for(rate = 0; rate < sizeof(bauds) / sizeof(bauds[0]); rate++){
+		if(!switch_baud(rate) || !read_comms(c, 1)){
+			printf("%-7u switch failed\n", bauds[rate]);
+			ok = 0;
+			continue;
+		}
+#ifdef IDLE_SLEEP
+		idle = sim_stats.idlecycles;
+#endif
+		start = wire = sim_stats.cycles;
+		bytes = 0;
+		for(sent = 0; sent < BURST; ){
+			// Keep the last byte queued so the stream has no gaps
+			for(n = 0; sent < BURST && n < MAXSTREAM; sent++){
+				plen = below(MAXPARAMS - 1);
+				for(j = 0; j < plen; j++)
+					params[j] = param();
+				i = stuff(s, raw, raw_frame(raw, 0, HDC, OTHERADDR, NOOP,
+				params, plen));
+				memcpy(burst + n, s, i);
+				n += i;
+			}
+			sim_uart_send(burst, n);
+			bytes += n;
+			wire += n * bytetime();
+			sim_run(wire - sim_stats.cycles - bytetime());
+		}
+		settle(wire + bytetime());
+		secs = (double) (sim_stats.cycles - start) / SIM_MIPS;
+		if(!read_comms(c, 0)){
+			printf("%-7u GCSX failed\n", bauds[rate]);
+			ok = 0;
+			continue;
+		}
+		c[5]--; // The GCSX read itself
+		if(c[5] != BURST || c[2] || c[4])
+			ok = 0;
+		printf("%-7u %6u %6ld %10.0f %10.0f", bauds[rate], BURST,
+		(long) BURST - (long) c[5], c[5] / secs, bytes / secs);
+#ifdef IDLE_SLEEP
+		idle = sim_stats.idlecycles - idle;
+		printf(" %8.1f %9.0f", 100.0 * (1 - (double) idle /
+		(sim_stats.cycles - start)), us(sim_stats.cycles - start - idle) /
+		BURST);
+#endif
+		printf("\n");
+	}
+	return ok;
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned cases = 2000, rate = 3;
+	uint8_t param0 = 0;
+	int i, ok;
+
+	for(i = 1; i < argc; i++){
+		if(!strcmp(argv[i], "-n") && i + 1 < argc)
+			cases = (unsigned) atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-s") && i + 1 < argc)
+			seed = (uint32_t) strtoul(argv[++i], NULL, 0);
+		else if(!strcmp(argv[i], "-b") && i + 1 < argc)
+			rate = (unsigned) atoi(argv[++i]);
+		else if(!strcmp(argv[i], "-v"))
+			verbose = 1;
+		else{
+			printf("Usage: hanfuzz [-n cases] [-s seed] [-b rate] [-v]\n");
+			exit(1);
+		}
+	}
+	if(!seed || rate >= sizeof(bauds) / sizeof(bauds[0])){
+		printf("Seed must be non zero, rate 0-3\n");
+		exit(1);
+	}
+
+	sim_txhook = txhook;
+	sim_init();
+	sim_run((uint64_t) SIM_MIPS * 2); // INA226 sampling under way
+	if(!command(GIPL, &param0, 1) || (rate && !switch_baud(rate))){
+		printf("Node did not answer\n");
+		exit(1);
+	}
+	irqframes = 0; // The boot IRQ
+	ok = fuzz(cases, rate);
+	ok &= gcst_wrap();
+	ok &= slotted(rate);
+	ok &= throughput();
+	exit(ok ? 0 : 1);
+}
@@ -0,0 +1,580 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <termios.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/ioctl.h>
+#endif
+#include "han.h"
+#include "hancrc.h"
+#include "hanmaster.h"
+
+/*
+ * Asynchronous HAN bus master library
+ *
+ * Implements the framing, byte stuffing, CRC8/CRC16 and ACK/NAK handling
+ * defined in han.h. See hanmaster.h for the interface.
+ */
+
+#define BATCHMAX	8			// Frames per write
+
+#ifdef __linux__
+/*
+ * The kernel's termios2, which takes any rate with BOTHER. It can't come
+ * from <asm/termbits.h>, that clashes with <termios.h>
+ */
+struct termios2 {
+	tcflag_t c_iflag;
+	tcflag_t c_oflag;
+	tcflag_t c_cflag;
+	tcflag_t c_lflag;
+	cc_t	c_line;
+	cc_t	c_cc[19];
+	speed_t	c_ispeed;
+	speed_t	c_ospeed;
+};
+#ifndef BOTHER
+#define BOTHER		0010000
+#endif
+#else
+#define BOTHER		B0			// No termios2, never a rate's code
+#endif
+
+struct han_master {
+	int	fd;
+	unsigned baud;
+	han_req_t *head;			// Queue
+	han_req_t *tail;
+	han_req_t *inflight;			// Waiting for its response
+	unsigned pending;
+	struct timespec deadline;
+	unsigned timeout_ms[256];		// Per node response timeout
+	han_deframer_t df;
+	han_irq_t irq;
+	void	*irqctx;
+};
+
+/*
+ * Time helpers
+ */
+
+static void now(struct timespec *t)
+{
+	clock_gettime(CLOCK_MONOTONIC, t);
+}
+
+double han_elapsed_us(const struct timespec *from, const struct timespec *to)
+{
+	return (to->tv_sec - from->tv_sec) * 1e6 +
+	(to->tv_nsec - from->tv_nsec) / 1e3;
+}
+
+static void add_ms(struct timespec *t, unsigned ms)
+{
+	t->tv_sec += ms / 1000;
+	t->tv_nsec += (long) (ms % 1000) * 1000000L;
+	if(t->tv_nsec >= 1000000000L){
+		t->tv_sec++;
+		t->tv_nsec -= 1000000000L;
+	}
+}
+
+/*
+ * True if a header control byte calls for a 16 bit CRC
+ */
+
+static int hcb_crc16(uint8_t hcb)
+{
+	hcb &= ~HDCFLAGS;
+	return (hcb == HDC16) || (hcb == HDCIRQ16) || (hcb == HDC_ACK16) ||
+	(hcb == HDC_NAK16);
+}
+
+/*
+ * Build a stuffed frame with STX/ETX and return its length. out must hold
+ * HAN_MAXFRAME bytes. Frames with more parameters than fit in MAXPARAMS
+ * are sent extended (HDCX).
+ */
+
+unsigned han_encode(uint8_t *out, uint8_t hcb, uint8_t addr, uint8_t cmd,
+const uint8_t *params, unsigned plen)
+{
+	uint8_t raw[MAXXPACKET + 2];
+	unsigned n = 0, i, o = 0;
+	uint16_t crc = 0;
+	int crc16 = hcb_crc16(hcb);
+
+	if(plen > MAXXPARAMS - (crc16 ? 2 : 1))
+		return 0;
+	if(plen > MAXPARAMS - (crc16 ? 2 : 1))
+		hcb |= HDCX;
+	raw[n++] = hcb;
+	raw[n++] = addr;
+	raw[n++] = cmd;
+	memcpy(raw + n, params, plen);
+	n += plen;
+	for(i = 0; i < n; i++)
+		crc = crc16 ? crc16_update(crc, raw[i]) :
+		crc8_update((uint8_t) crc, raw[i]);
+	raw[n++] = (uint8_t) crc;
+	if(crc16)
+		raw[n++] = (uint8_t) (crc >> 8);
+
+	out[o++] = STX;
+	for(i = 0; i < n; i++){
+		if(raw[i] <= SUBST)
+			out[o++] = SUBST;
+		out[o++] = raw[i];
+	}
+	out[o++] = ETX;
+	return o;
+}
+
+/*
+ * Feed one received byte to a deframer. Returns 1 when d->buf holds a
+ * complete frame of d->len bytes.
+ */
+
+int han_deframe(han_deframer_t *d, uint8_t c)
+{
+	if(!d->sub){
+		if(STX == c){
+			d->inframe = 1;
+			d->len = 0;
+			d->overflow = 0;
+			return 0;
+		}
+		if(ETX == c){
+			if(!d->inframe)
+				return 0;
+			d->inframe = 0;
+			return !d->overflow;
+		}
+		if(SUBST == c){
+			d->sub = 1;
+			return 0;
+		}
+	}
+	d->sub = 0;
+	if(d->inframe){
+		if(d->len < sizeof(d->buf))
+			d->buf[d->len++] = c;
+		else
+			d->overflow = 1;
+	}
+	return 0;
+}
+
+/*
+ * Check the length and trailing CRC of a deframed frame
+ */
+
+int han_check(const uint8_t *buf, unsigned len)
+{
+	int crc16;
+	uint16_t crc = 0;
+	unsigned i, n;
+
+	if(len < 1)
+		return 0;
+	crc16 = hcb_crc16(buf[0]);
+	if(len < (unsigned) ((buf[0] == HDCIRQ || buf[0] == HDCIRQ16) ?
+	PKTIRQLEN - (crc16 ? 0 : 1) : PKTCTRL + (crc16 ? 2 : 1)))
+		return 0;
+	n = len - (crc16 ? 2 : 1);
+	for(i = 0; i < n; i++)
+		crc = crc16 ? crc16_update(crc, buf[i]) :
+		crc8_update((uint8_t) crc, buf[i]);
+	if(crc16)
+		return (buf[n] | (buf[n + 1] << 8)) == crc;
+	return buf[n] == crc;
+}
+
+/*
+ * Append a (cmd, len, params[len]) sub-record to a GBAT request. Returns
+ * the offset of the sub-record, where its reply will be found, or -1 if
+ * it does not fit.
+ */
+
+int han_batch_add(han_req_t *req, uint8_t cmd, const uint8_t *params,
+uint8_t plen)
+{
+	unsigned at = req->plen;
+
+	if(at + 2 + plen > MAXXPARAMS - (req->crc16 ? 2 : 1))
+		return -1;
+	req->cmd = GBAT;
+	req->params[at] = cmd;
+	req->params[at + 1] = plen;
+	memcpy(req->params + at + 2, params, plen);
+	req->plen = (uint8_t) (at + 2 + plen);
+	return (int) at;
+}
+
+/*
+ * Decode a packed (HDCPK) payload of records of width values, each sent as
+ * a zig-zag varint delta from the same value in the record before, the
+ * first record from 0. Continuation bytes have the top bit set and carry 7
+ * bits, low first, the final byte carries the rest offset by SUBST + 1.
+ * Returns the number of values decoded, or -1 if the payload is malformed.
+ */
+
+int han_unpack(const uint8_t *in, unsigned len, uint16_t *out,
+unsigned width, unsigned max)
+{
+	unsigned i, n = 0, shift = 0;
+	uint16_t z = 0;
+
+	for(i = 0; i < len; i++){
+		if(in[i] & 0x80){
+			if(shift > 7)
+				return -1;
+			z |= (uint16_t) ((in[i] & 0x7F) << shift);
+			shift += 7;
+			continue;
+		}
+		if(in[i] <= SUBST || n >= max)
+			return -1;
+		z |= (uint16_t) ((in[i] - SUBST - 1) << shift);
+		out[n] = (uint16_t) ((z >> 1) ^ ((z & 1) ? 0xFFFF : 0));
+		if(n >= width)
+			out[n] += out[n - width];
+		n++;
+		z = 0;
+		shift = 0;
+	}
+	return shift ? -1 : (int) n;
+}
+
+/*
+ * Port setup
+ */
+
+static speed_t baud_code(unsigned baud)
+{
+	switch(baud){
+		case 9600:
+			return B9600;
+		case 19200:
+			return B19200;
+		case 38400:
+			return B38400;
+		case 57600:
+			return B57600;
+		case 115200:
+			return B115200;
+		case 230400:
+			return B230400;
+#ifdef __linux__
+		case 250000: // GBAU rate 3, set through termios2
+			return BOTHER;
+#endif
+		default:
+			return B0;
+	}
+}
+
+int han_set_baud(han_master_t *m, unsigned baud)
+{
+	struct termios tio;
+	speed_t code = baud_code(baud);
+
+	if(B0 == code || tcgetattr(m->fd, &tio) < 0)
+		return -1;
+	tcdrain(m->fd);
+	cfmakeraw(&tio);
+	tio.c_cflag |= CLOCAL | CREAD;
+	tio.c_cc[VMIN] = 0;
+	tio.c_cc[VTIME] = 0;
+	if(BOTHER != code){
+		cfsetispeed(&tio, code);
+		cfsetospeed(&tio, code);
+	}
+	if(tcsetattr(m->fd, TCSANOW, &tio) < 0)
+		return -1;
+#ifdef __linux__
+	if(BOTHER == code){
+		struct termios2 tio2;
+
+		if(ioctl(m->fd, TCGETS2, &tio2) < 0)
+			return -1;
+		tio2.c_cflag = (tio2.c_cflag & ~CBAUD) | BOTHER;
+		tio2.c_ispeed = tio2.c_ospeed = baud;
+		if(ioctl(m->fd, TCSETS2, &tio2) < 0)
+			return -1;
+	}
+#endif
+	m->baud = baud;
+	return 0;
+}
+
+han_master_t *han_open(const char *dev, unsigned baud)
+{
+	han_master_t *m;
+	unsigned i;
+
+	if(!(m = calloc(1, sizeof(*m))))
+		return NULL;
+	if((m->fd = open(dev, O_RDWR | O_NOCTTY | O_NONBLOCK)) < 0){
+		free(m);
+		return NULL;
+	}
+	if(han_set_baud(m, baud) < 0){
+		close(m->fd);
+		free(m);
+		return NULL;
+	}
+	tcflush(m->fd, TCIOFLUSH);
+	for(i = 0; i < 256; i++)
+		m->timeout_ms[i] = HAN_PKT_TIMEOUT_MS;
+	return m;
+}
+
+void han_close(han_master_t *m)
+{
+	close(m->fd);
+	free(m);
+}
+
+int han_fd(han_master_t *m)
+{
+	return m->fd;
+}
+
+/*
+ * Set the response timeout for one node. Defaults to the node's own packet
+ * timer, after which a node which has not answered never will.
+ */
+
+void han_set_timeout(han_master_t *m, uint8_t addr, unsigned ms)
+{
+	m->timeout_ms[addr] = ms;
+}
+
+/*
+ * Set the function called when a node sends an interrupt request
+ */
+
+void han_set_irq(han_master_t *m, han_irq_t fn, void *ctx)
+{
+	m->irq = fn;
+	m->irqctx = ctx;
+}
+
+void han_submit(han_master_t *m, han_req_t *req)
+{
+	req->status = HAN_PENDING;
+	req->next = NULL;
+	now(&req->submitted);
+	if(m->tail)
+		m->tail->next = req;
+	else
+		m->head = req;
+	m->tail = req;
+	m->pending++;
+}
+
+unsigned han_pending(han_master_t *m)
+{
+	return m->pending;
+}
+
+/*
+ * Completion
+ */
+
+static void complete(han_master_t *m, han_req_t *req, int status)
+{
+	req->status = status;
+	m->pending--;
+	if(req->done)
+		req->done(req, req->ctx);
+}
+
+static int write_all(int fd, const uint8_t *buf, unsigned len)
+{
+	struct pollfd pfd;
+	ssize_t n;
+
+	while(len){
+		n = write(fd, buf, len);
+		if(n < 0){
+			if(errno != EAGAIN && errno != EINTR)
+				return -1;
+			pfd.fd = fd;
+			pfd.events = POLLOUT;
+			poll(&pfd, 1, 100);
+			continue;
+		}
+		buf += n;
+		len -= (unsigned) n;
+	}
+	return 0;
+}
+
+/*
+ * Write the next batch: any broadcasts at the head of the queue, plus the
+ * first unicast request behind them, in one write. Returns the number of
+ * broadcasts completed.
+ */
+
+static int start_next(han_master_t *m)
+{
+	uint8_t buf[BATCHMAX * HAN_MAXFRAME];
+	han_req_t *req, *bcast[BATCHMAX];
+	unsigned len = 0, nb = 0, n, i;
+
+	m->inflight = NULL;
+	while((req = m->head) && nb < BATCHMAX){
+		n = han_encode(buf + len, (req->crc16 ? HDC16 : HDC) |
+		(req->pack ? HDCPK : 0), req->addr, req->cmd, req->params,
+		req->plen);
+		m->head = req->next;
+		if(!m->head)
+			m->tail = NULL;
+		if(!n){ // Too many parameters
+			complete(m, req, HAN_BADRESP);
+			continue;
+		}
+		len += n;
+		if((HAN_BCAST == req->addr) && !req->window_ms)
+			bcast[nb++] = req;
+		else{
+			m->inflight = req;
+			break;
+		}
+	}
+	if(!len)
+		return 0;
+
+	memset(&m->df, 0, sizeof(m->df));
+	if(write_all(m->fd, buf, len) < 0)
+		return -1;
+	for(i = 0; i < nb; i++){
+		now(&bcast[i]->sent);
+		complete(m, bcast[i], HAN_OK);
+	}
+	if(m->inflight){
+		now(&m->inflight->sent);
+		m->inflight->answered.tv_sec = 0;
+		m->deadline = m->inflight->sent;
+		add_ms(&m->deadline, (m->inflight->window_ms ?
+		m->inflight->window_ms : m->timeout_ms[m->inflight->addr]) +
+		(unsigned) (len * 10000UL / m->baud));
+	}
+	return (int) nb;
+}
+
+/*
+ * Handle a complete received frame
+ */
+
+static int rx_frame(han_master_t *m)
+{
+	han_req_t *req = m->inflight;
+	uint8_t *b = m->df.buf;
+	uint8_t hcb = b[0] & ~HDCFLAGS;
+	unsigned plen;
+
+	if(!han_check(b, m->df.len))
+		return 0;
+	if(HDCIRQ == b[0] || HDCIRQ16 == b[0]){
+		if(m->irq)
+			m->irq(b[1], m->irqctx);
+		return 0;
+	}
+	if(!req || b[2] != req->cmd)
+		return 0; // Not the response we are waiting for
+	if((req->crc16 && (HDC_ACK16 != hcb) && (HDC_NAK16 != hcb)) ||
+	(!req->crc16 && (HDC_ACK != hcb) && (HDC_NAK != hcb)))
+		return 0;
+	plen = m->df.len - PKTCTRL - (req->crc16 ? 2 : 1);
+	if(req->window_ms){ // Slotted, the window closes it
+		if(req->slot && (HDC_ACK == hcb || HDC_ACK16 == hcb))
+			req->slot(req, b[1], b + PKTCTRL, plen, req->ctx);
+		return 0;
+	}
+	if(b[1] != req->addr)
+		return 0;
+	m->inflight = NULL;
+	if((plen != req->plen) && !(b[0] & HDCX)){ // Only extended replies differ
+		complete(m, req, HAN_BADRESP);
+		return 1;
+	}
+	memcpy(req->params, b + PKTCTRL, plen);
+	req->rlen = (uint8_t) plen;
+	req->pack = (b[0] & HDCPK) ? 1 : 0;
+	complete(m, req, (HDC_ACK == hcb || HDC_ACK16 == hcb) ? HAN_OK : HAN_NAK);
+	return 1;
+}
+
+/*
+ * Drive the port for up to timeout_ms, or less if something completes.
+ * Returns the number of requests completed, or -1 on an I/O error.
+ */
+
+int han_poll(han_master_t *m, int timeout_ms)
+{
+	struct pollfd pfd;
+	struct timespec t, end;
+	uint8_t buf[256];
+	int done = 0, wait, r;
+	ssize_t n, i;
+
+	now(&end);
+	add_ms(&end, timeout_ms);
+	for(;;){
+		while(!m->inflight && m->head){
+			if((r = start_next(m)) < 0)
+				return -1;
+			done += r;
+		}
+		if(done)
+			return done;
+
+		now(&t);
+		wait = (int) (han_elapsed_us(&t, &end) / 1000);
+		if(m->inflight){
+			int dl = (int) (han_elapsed_us(&t, &m->deadline) / 1000);
+			if(dl < wait)
+				wait = dl;
+		}
+		if(wait < 0)
+			wait = 0;
+
+		pfd.fd = m->fd;
+		pfd.events = POLLIN;
+		r = poll(&pfd, 1, wait);
+		if(r < 0 && errno != EINTR)
+			return -1;
+
+		if(r > 0 && (pfd.revents & POLLIN)){
+			n = read(m->fd, buf, sizeof(buf));
+			if(n < 0 && errno != EAGAIN && errno != EINTR)
+				return -1;
+			for(i = 0; i < n; i++){
+				if(m->inflight && !m->inflight->answered.tv_sec)
+					now(&m->inflight->answered);
+				if(han_deframe(&m->df, buf[i]))
+					done += rx_frame(m);
+			}
+		}
+
+		now(&t);
+		if(m->inflight && han_elapsed_us(&m->deadline, &t) >= 0){
+			han_req_t *req = m->inflight;
+			m->inflight = NULL;
+			complete(m, req, req->window_ms ? HAN_OK : HAN_TIMEOUT);
+			done++;
+		}
+		if(done)
+			return done;
+		if(han_elapsed_us(&end, &t) >= 0)
+			return 0;
+	}
+}
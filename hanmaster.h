@@ -0,0 +1,92 @@
+/*
+* hanmaster.h
+*
+* Asynchronous HAN bus master library for Linux. Include <stdint.h> and
+* han.h first.
+*
+* Requests are queued with han_submit() and go out one at a time on the
+* half duplex bus, the next one written as soon as the previous one
+* completes. han_poll() drives the serial port and calls each request's
+* completion function. Consecutive broadcasts, which are never answered,
+* are batched into a single write. A slotted broadcast (GSLT) with a
+* window holds the bus for that long, handing each node's answer to the
+* slot function, then completes.
+*/
+
+#ifndef HANMASTER
+#define HANMASTER
+
+#include <time.h>
+
+#define HAN_MAXFRAME	(2 * (MAXXPACKET) + 2)	// Worst case stuffed frame
+#define HAN_BCAST	0xFF			// Broadcast address
+#define HAN_PKT_TIMEOUT_MS 262			// Node packet timer, 255 * 1.024 mSec
+
+// Request status
+enum {HAN_PENDING = 0, HAN_OK, HAN_NAK, HAN_TIMEOUT, HAN_BADRESP};
+
+typedef struct han_req han_req_t;
+typedef void (*han_done_t)(han_req_t *req, void *ctx);
+typedef void (*han_slot_t)(han_req_t *req, uint8_t addr,
+const uint8_t *params, unsigned plen, void *ctx);
+
+struct han_req {
+	uint8_t	addr;				// Node address, HAN_BCAST for broadcast
+	uint8_t	cmd;				// Command
+	uint8_t	crc16;				// Non zero to use 16 bit CRC's
+	uint8_t	pack;				// Non zero to ask for a packed reply, set if one came back
+	uint8_t	plen;				// Parameter length
+	uint8_t	rlen;				// Response parameter length
+	uint8_t	params[MAXXPARAMS];		// Parameters, replaced by the response
+	int	status;				// Completion status
+	struct timespec submitted;		// han_submit() time
+	struct timespec sent;			// Request written
+	struct timespec answered;		// First response byte seen
+	han_done_t done;			// Completion function
+	unsigned window_ms;			// Broadcast answered in slots (GSLT) over this long, else 0
+	han_slot_t slot;			// Called with each slotted answer
+	void	*ctx;				// Completion context
+	han_req_t *next;			// Queue link, private
+};
+
+// Frame deframer state
+typedef struct {
+	uint8_t	buf[MAXXPACKET + 1];
+	uint8_t	len;
+	uint8_t	inframe;
+	uint8_t	sub;
+	uint8_t	overflow;
+} han_deframer_t;
+
+typedef struct han_master han_master_t;
+typedef void (*han_irq_t)(uint8_t addr, void *ctx);
+
+/*
+* Framing helpers, usable without a port
+*/
+
+unsigned han_encode(uint8_t *out, uint8_t hcb, uint8_t addr, uint8_t cmd,
+const uint8_t *params, unsigned plen);
+int han_deframe(han_deframer_t *d, uint8_t c);
+int han_check(const uint8_t *buf, unsigned len);
+int han_batch_add(han_req_t *req, uint8_t cmd, const uint8_t *params,
+uint8_t plen);
+int han_unpack(const uint8_t *in, unsigned len, uint16_t *out,
+unsigned width, unsigned max);
+
+/*
+* Master
+*/
+
+han_master_t *han_open(const char *dev, unsigned baud);
+int han_set_baud(han_master_t *m, unsigned baud);
+void han_close(han_master_t *m);
+int han_fd(han_master_t *m);
+void han_set_timeout(han_master_t *m, uint8_t addr, unsigned ms);
+void han_set_irq(han_master_t *m, han_irq_t fn, void *ctx);
+void han_submit(han_master_t *m, han_req_t *req);
+unsigned han_pending(han_master_t *m);
+int han_poll(han_master_t *m, int timeout_ms);
+double han_elapsed_us(const struct timespec *from, const struct timespec *to);
+
+#endif
@@ -0,0 +1,60 @@
+/*
+* inacal.h
+*
+* INA226 calibration math. Shared by the firmware and caldb, so the
+* values caldb reports are the ones a node will use. Include <stdint.h>
+* first.
+*
+* The current LSB is the shunt rating over 2^15, in 1e-7 amps, and the
+* power LSB is 25 times that. The calibration register is
+* 0.00512 / (current LSB x shunt resistance). With the resistance as
+* mv / amps, the amps cancel and it is 167772.16 / mv, so it comes from
+* a table in flash. Nothing here divides, which is slow on the PIC.
+*/
+
+#ifndef INACAL
+#define INACAL
+
+#define INACAL_AMPS_MAX	200			// Legal shunt ratings
+#define INACAL_MV_MAX	80
+#define INACAL_CAL_MAX	0x7FFF			// Calibration register is 15 bits
+
+typedef struct {
+	uint16_t cal;				// Calibration register
+	uint32_t current_lsb;			// Current LSB in 1e-7 amps
+	uint32_t power_lsb;			// Power LSB in 1e-7 watts
+} inacal_t;
+
+// Calibration for 1 to INACAL_MV_MAX mV, rounded, clamped to the register
+// (under 6 mV cannot be calibrated). Printed by caldb -g
+static const uint16_t inacal_cal[INACAL_MV_MAX] = {
+	32767, 32767, 32767, 32767, 32767, 27962, 23967, 20972,
+	18641, 16777, 15252, 13981, 12906, 11984, 11185, 10486,
+	9869, 9321, 8830, 8389, 7989, 7626, 7294, 6991,
+	6711, 6453, 6214, 5992, 5785, 5592, 5412, 5243,
+	5084, 4934, 4793, 4660, 4534, 4415, 4302, 4194,
+	4092, 3995, 3902, 3813, 3728, 3647, 3570, 3495,
+	3424, 3355, 3290, 3226, 3166, 3107, 3050, 2996,
+	2943, 2893, 2844, 2796, 2750, 2706, 2663, 2621,
+	2581, 2542, 2504, 2467, 2431, 2397, 2363, 2330,
+	2298, 2267, 2237, 2208, 2179, 2151, 2124, 2097
+};
+
+/*
+* Calculate the calibration for a shunt of amps and mv full scale.
+* 1e7 = 305 x 2^15 + 45 x 2^7, so the current LSB, (1e7 x amps) >> 15,
+* is exactly 305 x amps + ((45 x amps) >> 8) in 16 bit products
+*/
+
+static void inacal_calc(inacal_t *c, uint16_t amps, uint8_t mv)
+{
+	uint16_t lsb;
+
+	lsb = 305 * amps + ((45 * amps) >> 8);
+	c->current_lsb = lsb;
+	c->power_lsb = ((uint32_t) lsb << 4) + ((uint32_t) lsb << 3) + lsb;
+	c->cal = (mv && (mv <= INACAL_MV_MAX)) ? inacal_cal[mv - 1] :
+	INACAL_CAL_MAX;
+}
+
+#endif
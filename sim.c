@@ -0,0 +1,712 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include "hal.h"
+
+/*
+ * Single node simulator for batterymon.c
+ *
+ * Models the PIC16F1 UART, MSSP in I2C master mode, timer 0, EEPROM and an
+ * INA226 on the I2C bus closely enough to run the unmodified firmware on a
+ * Linux host. Simulated time is kept in instruction cycles (Fosc/4). Each
+ * pass through CLRWDT() costs sim_fgcycles, each interrupt entry costs
+ * sim_isrcycles and each handler it runs sim_srccycles for its source, so
+ * latencies are modeled, not measured. Host time spent
+ * in the firmware is measured separately. SLEEP() is modeled as the Idle
+ * mode of parts which have one: the core stops, peripherals keep running.
+ *
+ * Built together with the firmware and a front end, see batsim.c.
+ */
+
+/*
+ * Registers
+ */
+
+volatile PORTA_t sim_PORTA;
+volatile LATA_t sim_LATA;
+volatile PORTC_t sim_PORTC;
+volatile LATC_t sim_LATC;
+volatile INTCON_t sim_INTCON;
+volatile PIR1_t sim_PIR1;
+volatile PIE1_t sim_PIE1;
+volatile TXSTA_t sim_TXSTA;
+volatile RCSTA_t sim_RCSTA;
+volatile BAUDCON_t sim_BAUDCON;
+volatile SSP1CON1_t sim_SSP1CON1;
+volatile SSP1CON2_t sim_SSP1CON2;
+volatile EECON1_t sim_EECON1;
+
+volatile uint8_t OSCCON, APFCON0, APFCON1, ANSELA, ANSELC, TRISA, TRISC,
+WPUA, WPUC, SPBRGL, SPBRGH, SSP1CON3, SSPADD, SSPSTAT, OPTION_REG, T1CON;
+volatile uint16_t TXREG, SSP1BUF;
+
+/*
+ * Public model state
+ */
+
+sim_stats_t sim_stats;
+sim_ina226_t sim_ina226;
+uint32_t sim_fgcycles = 20;
+uint32_t sim_isrcycles = 20;
+uint32_t sim_srccycles[SIM_SOURCES] = {40, 150, 80, 10, 50};
+uint64_t sim_rxlast;
+uint64_t sim_txfirst;                           // Cleared by the front end
+unsigned sim_hostbittime;
+void (*sim_txhook)(uint8_t c);
+
+/*
+ * Private model state
+ */
+
+#define TIMER0_CYCLES	8192			// 256 * 1:32 prescale
+#define RXWIRE		4096			// Bytes queued on the wire
+#define TXCAPTURE	4096			// Bytes captured from the node
+#define RXFIFO		2			// EUSART receive FIFO depth
+#define SLEEPSTEP	8			// Cycles between wake checks in SLEEP()
+#define EEWRITE_CYCLES	(SIM_MIPS * 4 / 1000)	// 4 mSec EEPROM write
+
+enum {I2C_IDLE = 0, I2C_ADDR, I2C_PTR, I2C_DATAHI, I2C_DATALO, I2C_RDHI, I2C_RDLO};
+
+static struct {
+	uint8_t wire[RXWIRE];			// Bytes on the way to the node
+	unsigned whead, wtail;
+	uint64_t wnext;				// Cycle the next byte arrives
+	uint8_t fifo[RXFIFO];
+	uint64_t farrived[RXFIFO];		// Cycle each FIFO byte arrived
+	uint8_t fferr[RXFIFO];			// Framing error for each FIFO byte
+	unsigned fcount;
+	uint8_t last;
+	int tsrbusy;				// Shift register loaded
+	uint8_t tsr;
+	int txregfull;
+	uint8_t txreg;
+	uint64_t tsrdone;			// Cycle the shift register empties
+	uint8_t cap[TXCAPTURE];			// Bytes sent by the node
+	unsigned chead, ctail;
+} uart;
+
+static struct {
+	uint64_t done;				// Cycle the current operation finishes
+	int busy;
+	int op;					// Pending operation
+	uint8_t rxbyte;
+	int phase;				// INA226 protocol phase
+	uint8_t ptr;				// INA226 register pointer
+	uint16_t wval;
+	uint64_t nextconv;			// Cycle of the next conversion
+} i2c_m;
+
+enum {OP_NONE = 0, OP_START, OP_STOP, OP_TX, OP_RX, OP_ACK};
+
+static uint8_t eeprom[256];
+static uint64_t eedone;				// Cycle the EEPROM write finishes
+static uint64_t nexttimer0;
+static int inisr;
+static unsigned isrsrcs;			// Sources pending at isr() entry
+static struct timespec lastexit;
+
+static uint64_t ns_since(struct timespec *t)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t) (now.tv_sec - t->tv_sec) * 1000000000ULL +
+	(uint64_t) (now.tv_nsec - t->tv_nsec);
+}
+
+/*
+ * EEPROM
+ */
+
+/*
+ * Like the compiler library, both wait out a write in progress, with
+ * interrupts running
+ */
+
+uint8_t eeprom_read(uint8_t addr)
+{
+	while(EECON1bits.WR)
+		sim_step();
+	return eeprom[addr];
+}
+
+void eeprom_write(uint8_t addr, uint8_t value)
+{
+	while(EECON1bits.WR)
+		sim_step();
+	eeprom[addr] = value;
+	sim_stats.eewrites++;
+	EECON1bits.WR = 1;
+	eedone = sim_stats.cycles + EEWRITE_CYCLES;
+}
+
+/*
+ * UART
+ */
+
+unsigned sim_uart_bittime(void)
+{
+	unsigned div;
+
+	// Instruction cycles per bit
+	if(BAUDCONbits.BRG16)
+		div = TXSTAbits.BRGH ? 1 : 4;
+	else
+		div = TXSTAbits.BRGH ? 4 : 16;
+	return div * ((((unsigned) SPBRGH << 8) | SPBRGL) + 1);
+}
+
+static uint64_t uart_bytetime(void)
+{
+	return 10 * (uint64_t) sim_uart_bittime();
+}
+
+static uint64_t host_bytetime(void)
+{
+	return sim_hostbittime ? 10 * (uint64_t) sim_hostbittime : uart_bytetime();
+}
+
+/*
+ * True if the host and node rates differ by more than a receiver tolerates
+ */
+
+static int uart_mismatch(void)
+{
+	unsigned node = sim_uart_bittime();
+
+	if(!sim_hostbittime)
+		return 0;
+	return (sim_hostbittime > node ? sim_hostbittime - node :
+	node - sim_hostbittime) * 100 > 3 * node;
+}
+
+uint8_t sim_uart_getc(void)
+{
+	if(uart.fcount){
+		if(sim_stats.cycles - uart.farrived[0] > sim_stats.rxlatmax)
+			sim_stats.rxlatmax = sim_stats.cycles - uart.farrived[0];
+		uart.last = uart.fifo[0];
+		uart.fifo[0] = uart.fifo[1];
+		uart.farrived[0] = uart.farrived[1];
+		uart.fferr[0] = uart.fferr[1];
+		uart.fcount--;
+	}
+	return uart.last;
+}
+
+/*
+ * RCSTA bit access. A CREN cleared by the last access resets the
+ * receiver, clearing OERR, before this one sets it again
+ */
+
+volatile RCSTA_t *sim_rcsta(void)
+{
+	if(!sim_RCSTA.bits.CREN)
+		sim_RCSTA.bits.OERR = 0;
+	sim_RCSTA.bits.FERR = uart.fcount && uart.fferr[0];
+	return &sim_RCSTA;
+}
+
+/*
+ * True if the flag the firmware clears for an interrupt source is set
+ */
+
+static int src_flag(unsigned src)
+{
+	switch(src){
+		case SIM_RDA:
+			return PIR1bits.RCIF;
+		case SIM_TMR0:
+			return INTCONbits.T0IF;
+		case SIM_I2C:
+			return PIR1bits.SSP1IF;
+		case SIM_INT:
+			return INTCONbits.INTF;
+		default:
+			return PIE1bits.TXIE && PIR1bits.TXIF;
+	}
+}
+
+/*
+ * Modeled cycles of the handlers run so far in this isr() entry. A handler
+ * counts as run once its flag is clear, as the firmware clears each one
+ * either side of the handler
+ */
+
+static uint32_t isr_elapsed(int all)
+{
+	uint32_t c = 0;
+	unsigned src;
+
+	for(src = 0; src < SIM_SOURCES; src++)
+		if((isrsrcs & (1 << src)) && (all || !src_flag(src)))
+			c += sim_srccycles[src];
+	return c;
+}
+
+/*
+ * Timer1, instruction clock only, free running from reset. Inside isr()
+ * it moves on with the handlers run
+ */
+
+uint8_t sim_tmr1(int high)
+{
+	uint64_t t;
+
+	if(!(T1CON & 0x01))
+		return 0;
+	t = sim_stats.cycles + ((inisr) ? isr_elapsed(0) : 0);
+	t >>= (T1CON >> 4) & 0x03;
+	return (uint8_t) (high ? t >> 8 : t);
+}
+
+void sim_uart_send(const uint8_t *buf, unsigned len)
+{
+	if(uart.whead == uart.wtail && uart.wnext < sim_stats.cycles)
+		uart.wnext = sim_stats.cycles + host_bytetime();
+	while(len--){
+		uart.wire[uart.whead] = *buf++;
+		uart.whead = (uart.whead + 1) % RXWIRE;
+	}
+}
+
+unsigned sim_uart_recv(uint8_t *buf, unsigned max)
+{
+	unsigned n = 0;
+
+	while(n < max && uart.ctail != uart.chead){
+		buf[n++] = uart.cap[uart.ctail];
+		uart.ctail = (uart.ctail + 1) % TXCAPTURE;
+	}
+	return n;
+}
+
+static void uart_model(void)
+{
+	uint64_t now = sim_stats.cycles;
+
+	// Receive side
+	while(uart.wtail != uart.whead && now >= uart.wnext){
+		if(sim_RCSTA.bits.SPEN && sim_RCSTA.bits.CREN && !sim_RCSTA.bits.OERR){
+			if(uart.fcount < RXFIFO){
+				// Garbled, with a framing error, if mismatched
+				uart.farrived[uart.fcount] = uart.wnext;
+				uart.fferr[uart.fcount] = (uint8_t) uart_mismatch();
+				sim_stats.framing += uart.fferr[uart.fcount];
+				uart.fifo[uart.fcount++] = uart.wire[uart.wtail] ^
+				(uart_mismatch() ? 0x55 : 0);
+			}
+			else{
+				sim_RCSTA.bits.OERR = 1;
+				sim_stats.overruns++;
+			}
+		}
+		sim_stats.rxbytes++;
+		sim_rxlast = uart.wnext;
+		uart.wtail = (uart.wtail + 1) % RXWIRE;
+		uart.wnext += host_bytetime();
+	}
+	PIR1bits.RCIF = (uart.fcount != 0);
+
+	// Transmit side
+	if(TXREG != SIM_NOWRITE){
+		uart.txreg = (uint8_t) TXREG;
+		uart.txregfull = 1;
+		TXREG = SIM_NOWRITE;
+	}
+	if(uart.tsrbusy && now >= uart.tsrdone){
+		if(uart_mismatch())
+			uart.tsr ^= 0x55; // Garbled at the host
+		uart.cap[uart.chead] = uart.tsr;
+		uart.chead = (uart.chead + 1) % TXCAPTURE;
+		if(sim_txhook)
+			sim_txhook(uart.tsr);
+		sim_stats.txbytes++;
+		uart.tsrbusy = 0;
+	}
+	if(!uart.tsrbusy && uart.txregfull){
+		if(!sim_txfirst)
+			sim_txfirst = now;
+		uart.tsr = uart.txreg;
+		uart.txregfull = 0;
+		uart.tsrbusy = 1;
+		uart.tsrdone = now + uart_bytetime();
+	}
+	PIR1bits.TXIF = TXSTAbits.TXEN && !uart.txregfull;
+	TXSTAbits.TRMT = !uart.tsrbusy;
+}
+
+/*
+ * INA226
+ */
+
+/*
+ * Drive ALERT (RA2, active low, transparent mode) from the enabled alert
+ * function, and raise INTF on the selected edge
+ */
+
+static void ina226_alert(void)
+{
+	sim_ina226_t *m = &sim_ina226;
+	uint16_t mask = m->regs[6], lim = m->regs[7];
+	int alert = 0, level;
+
+	if(mask & 0x8000)
+		alert = (int16_t) m->regs[1] > (int16_t) lim;
+	else if(mask & 0x4000)
+		alert = (int16_t) m->regs[1] < (int16_t) lim;
+	else if(mask & 0x2000)
+		alert = m->regs[2] > lim;
+	else if(mask & 0x1000)
+		alert = m->regs[2] < lim;
+	else if(mask & 0x0800)
+		alert = m->regs[3] > lim;
+	if(alert)
+		m->regs[6] |= 0x0010; // AFF
+	level = (mask & 0x0002) ? alert : !alert;
+	if(level != PORTAbits.RA2){
+		PORTAbits.RA2 = level;
+		if(level == ((OPTION_REG & 0x40) != 0))
+			INTCONbits.INTF = 1;
+	}
+}
+
+static void ina226_convert(void)
+{
+	sim_ina226_t *m = &sim_ina226;
+	double shunt = m->amps * m->rshunt / 2.5e-6;
+	double bus = m->volts / 1.25e-3;
+	int32_t current;
+	uint32_t power;
+
+	if(shunt > 32767)
+		shunt = 32767;
+	if(shunt < -32768)
+		shunt = -32768;
+	if(bus > 32767)
+		bus = 32767;
+	if(bus < 0)
+		bus = 0;
+	m->regs[1] = (uint16_t) (int16_t) shunt;
+	m->regs[2] = (uint16_t) bus;
+	current = ((int32_t) (int16_t) m->regs[1] * m->regs[5]) / 2048;
+	if(current > 32767)
+		current = 32767;
+	if(current < -32768)
+		current = -32768;
+	power = ((uint32_t) abs(current) * m->regs[2]) / 20000;
+	if(power > 0xFFFF)
+		power = 0xFFFF;
+	m->regs[4] = (uint16_t) current;
+	m->regs[3] = (uint16_t) power;
+	m->regs[6] |= 0x0008; // CVRF
+	ina226_alert();
+}
+
+static uint64_t ina226_convtime(void)
+{
+	static const uint16_t ct[8] = {140, 204, 332, 588, 1100, 2116, 4156, 8244};
+	static const uint16_t avg[8] = {1, 4, 16, 64, 128, 256, 512, 1024};
+	uint16_t cfg = sim_ina226.regs[0];
+	uint64_t us;
+
+	us = (uint64_t) avg[(cfg >> 9) & 7] *
+	(ct[(cfg >> 6) & 7] + ct[(cfg >> 3) & 7]);
+	return us * (SIM_MIPS / 1000000);
+}
+
+static void ina226_write(uint8_t ptr, uint16_t val)
+{
+	if(ptr == 0 && (val & 0x8000)){ // Reset
+		sim_ina226.regs[0] = 0x4127;
+		sim_ina226.regs[5] = 0;
+		return;
+	}
+	if(ptr == 0 || ptr == 5 || ptr == 7)
+		sim_ina226.regs[ptr] = val;
+	if(ptr == 6) // Flag bits are read only
+		sim_ina226.regs[6] = (val & 0xFC03) | (sim_ina226.regs[6] & 0x001C);
+	if(ptr == 0)
+		i2c_m.nextconv = sim_stats.cycles + ina226_convtime();
+}
+
+static uint16_t ina226_read(uint8_t ptr)
+{
+	uint16_t val;
+
+	if(ptr == 0xFE)
+		return 0x5449;
+	if(ptr == 0xFF)
+		return 0x2260;
+	val = sim_ina226.regs[ptr & 7];
+	if(ptr == 6)
+		sim_ina226.regs[6] &= ~0x0018; // Read clears CVRF and AFF
+	return val;
+}
+
+static void ina226_byte(uint8_t b)
+{
+	switch(i2c_m.phase){
+		case I2C_ADDR:
+			if((b & 0xFE) != 0x80)
+				i2c_m.phase = I2C_IDLE; // Not us, no ack
+			else if(b & 1)
+				i2c_m.phase = I2C_RDHI;
+			else
+				i2c_m.phase = I2C_PTR;
+			break;
+
+		case I2C_PTR:
+			i2c_m.ptr = b;
+			i2c_m.phase = I2C_DATAHI;
+			break;
+
+		case I2C_DATAHI:
+			i2c_m.wval = (uint16_t) b << 8;
+			i2c_m.phase = I2C_DATALO;
+			break;
+
+		case I2C_DATALO:
+			i2c_m.wval |= b;
+			ina226_write(i2c_m.ptr, i2c_m.wval);
+			i2c_m.phase = I2C_IDLE;
+			break;
+
+		default:
+			break;
+	}
+}
+
+/*
+ * MSSP in I2C master mode. One operation at a time, each raising SSP1IF
+ * when it completes.
+ */
+
+static void i2c_model(void)
+{
+	uint64_t now = sim_stats.cycles;
+	uint64_t bit = (uint64_t) SSPADD + 1; // Instruction cycles per SCL
+
+	// Conversions
+	if(now >= i2c_m.nextconv){
+		ina226_convert();
+		i2c_m.nextconv = now + ina226_convtime();
+	}
+
+	if(!SSP1CON1bits.SSPEN)
+		return;
+
+	if(i2c_m.busy){
+		if(now < i2c_m.done)
+			return;
+		switch(i2c_m.op){
+			case OP_START:
+				SSP1CON2bits.SEN = 0;
+				SSP1CON2bits.RSEN = 0;
+				i2c_m.phase = I2C_ADDR;
+				break;
+
+			case OP_STOP:
+				SSP1CON2bits.PEN = 0;
+				i2c_m.phase = I2C_IDLE;
+				sim_stats.i2ctrans++;
+				break;
+
+			case OP_RX:
+				SSP1CON2bits.RCEN = 0;
+				SSP1BUF = SIM_RXBYTE | i2c_m.rxbyte;
+				break;
+
+			case OP_ACK:
+				SSP1CON2bits.ACKEN = 0;
+				break;
+
+			default:
+				break;
+		}
+		i2c_m.busy = 0;
+		PIR1bits.SSP1IF = 1;
+		return;
+	}
+
+	if(SSP1CON2bits.SEN || SSP1CON2bits.RSEN){
+		i2c_m.op = OP_START;
+		i2c_m.done = now + bit;
+	}
+	else if(SSP1CON2bits.PEN){
+		i2c_m.op = OP_STOP;
+		i2c_m.done = now + bit;
+	}
+	else if(SSP1BUF < SIM_NOWRITE){
+		ina226_byte((uint8_t) SSP1BUF);
+		SSP1BUF = SIM_NOWRITE;
+		i2c_m.op = OP_TX;
+		i2c_m.done = now + 9 * bit;
+	}
+	else if(SSP1CON2bits.RCEN){
+		if(i2c_m.phase == I2C_RDHI){
+			i2c_m.wval = ina226_read(i2c_m.ptr);
+			i2c_m.rxbyte = (uint8_t) (i2c_m.wval >> 8);
+			i2c_m.phase = I2C_RDLO;
+		}
+		else
+			i2c_m.rxbyte = (uint8_t) i2c_m.wval;
+		i2c_m.op = OP_RX;
+		i2c_m.done = now + 8 * bit;
+	}
+	else if(SSP1CON2bits.ACKEN){
+		i2c_m.op = OP_ACK;
+		i2c_m.done = now + bit;
+	}
+	else
+		return;
+	i2c_m.busy = 1;
+}
+
+/*
+ * Interrupt dispatch
+ */
+
+/*
+ * True if an enabled interrupt is pending, which wakes SLEEP() whether
+ * or not GIE is set
+ */
+
+static int wake_pending(void)
+{
+	if(INTCONbits.T0IE && INTCONbits.T0IF)
+		return 1;
+	if(INTCONbits.INTE && INTCONbits.INTF)
+		return 1;
+	if(INTCONbits.PEIE && (PIE1 & PIR1))
+		return 1;
+	return 0;
+}
+
+static int irq_pending(void)
+{
+	if(!INTCONbits.GIE)
+		return 0;
+	return wake_pending();
+}
+
+static void peripherals(void)
+{
+	if(sim_stats.cycles >= nexttimer0){
+		INTCONbits.T0IF = 1;
+		nexttimer0 += TIMER0_CYCLES;
+	}
+	if(EECON1bits.WR && (sim_stats.cycles >= eedone))
+		EECON1bits.WR = 0;
+	uart_model();
+	i2c_model();
+}
+
+/*
+ * Advance simulated time by one foreground pass and run any interrupts
+ * which became pending. Called from CLRWDT().
+ */
+
+void sim_step(void)
+{
+	struct timespec t;
+	unsigned c;
+	int n;
+
+	if(inisr)
+		return;
+
+	sim_stats.fgns += ns_since(&lastexit);
+	sim_stats.fgpasses++;
+	sim_stats.cycles += sim_fgcycles;
+
+	peripherals();
+	for(n = 0; n < 8 && irq_pending(); n++){
+		sim_stats.isrcalls++;
+		sim_stats.isrcycles += sim_isrcycles;
+		sim_stats.cycles += sim_isrcycles;
+		INTCONbits.GIE = 0;
+		for(isrsrcs = 0, c = 0; c < SIM_SOURCES; c++)
+			if(src_flag(c))
+				isrsrcs |= 1 << c;
+		inisr = 1;
+		clock_gettime(CLOCK_MONOTONIC, &t);
+		isr();
+		sim_stats.isrns += ns_since(&t);
+		inisr = 0;
+		c = isr_elapsed(1);
+		sim_stats.isrcycles += c;
+		sim_stats.cycles += c;
+		INTCONbits.GIE = 1;
+		peripherals(); // Flags the firmware cleared but the part would not
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &lastexit);
+}
+
+/*
+ * Stop the core until an enabled interrupt is pending. With GIE clear, as
+ * the firmware calls it, the foreground resumes and the interrupt is taken
+ * at the next ei()
+ */
+
+void sim_sleep(void)
+{
+	sim_stats.sleeps++;
+	peripherals();
+	while(!wake_pending()){
+		sim_stats.cycles += SLEEPSTEP;
+		sim_stats.idlecycles += SLEEPSTEP;
+		peripherals();
+	}
+}
+
+/*
+ * Hold the core, interrupts included, while the peripherals run on, as a
+ * long di() section would
+ */
+
+void sim_stall(uint64_t cycles)
+{
+	uint64_t end = sim_stats.cycles + cycles;
+
+	while(sim_stats.cycles < end){
+		sim_stats.cycles += SLEEPSTEP;
+		peripherals();
+	}
+}
+
+/*
+ * Reset the model and run the firmware initialization
+ */
+
+void sim_init(void)
+{
+	memset(&sim_stats, 0, sizeof(sim_stats));
+	memset(&uart, 0, sizeof(uart));
+	memset(&i2c_m, 0, sizeof(i2c_m));
+	memset(eeprom, 0xFF, sizeof(eeprom));
+	EECON1 = 0;
+	TXREG = SSP1BUF = SIM_NOWRITE;
+	sim_PORTA.byte = 0x04; // Address jumper installed, ALERT released
+	sim_ina226.regs[0] = 0x4127;
+	if(!sim_ina226.rshunt)
+		sim_ina226.rshunt = 0.050 / 200;
+	nexttimer0 = TIMER0_CYCLES;
+	i2c_m.nextconv = ina226_convtime();
+	clock_gettime(CLOCK_MONOTONIC, &lastexit);
+	node_init();
+}
+
+/*
+ * Run the foreground loop for a number of cycles
+ */
+
+void sim_run(uint64_t cycles)
+{
+	uint64_t end = sim_stats.cycles + cycles;
+
+	while(sim_stats.cycles < end)
+		node_poll();
+}
@@ -0,0 +1,185 @@
+/*
+* sim.h
+*
+* Host side model of the PIC16F1 peripherals used by batterymon.c.
+* Included through hal.h when SIMULATOR is defined.
+*
+* SFR's are unions so the byte and bit views alias like they do on the
+* part. Registers the model has to see written (TXREG, SSP1BUF) are 16 bits
+* wide and hold SIM_NOWRITE until the firmware stores a byte in them. A
+* byte received by the MSSP is flagged with SIM_RXBYTE so it is not taken
+* for a write when it lands in SSP1BUF.
+* RCREG is a function so the model sees the read which pops the FIFO.
+* RCSTAbits goes through a function too, so the model sees CREN cleared
+* (which clears OERR) on the next access, and FERR follows the byte at
+* the head of the FIFO.
+* TMR1L and TMR1H are computed from the cycle count. Time only moves
+* between foreground passes and interrupt entries, so code timed within
+* a foreground pass reads as taking no time. Within isr() Timer1 moves on
+* by sim_srccycles for each source as its handler clears its flag.
+* An EEPROM write holds EECON1 WR for 4 mSec. eeprom_read() and
+* eeprom_write() wait it out, stepping the model as they do.
+*/
+
+#ifndef SIM
+#define SIM
+
+#include <stdint.h>
+
+/*
+* Compiler intrinsics
+*/
+
+typedef unsigned char bit;
+
+#define interrupt
+#define __CONFIG(x)
+#define CLRWDT()	sim_step()
+#define NOP()		sim_step()
+#define SLEEP()		sim_sleep()
+#define di()		(sim_INTCON.bits.GIE = 0)
+#define ei()		(sim_INTCON.bits.GIE = 1)
+
+uint8_t eeprom_read(uint8_t addr);
+void eeprom_write(uint8_t addr, uint8_t value);
+
+/*
+* Special function registers
+*/
+
+#define SIM_NOWRITE 0x100
+#define SIM_RXBYTE 0x200
+
+#define SIM_SFR(NAME, FIELDS) typedef union {uint8_t byte; struct {FIELDS} bits;}\
+NAME##_t; extern volatile NAME##_t sim_##NAME;
+
+SIM_SFR(PORTA, unsigned RA0:1; unsigned RA1:1; unsigned RA2:1; unsigned RA3:1;
+	unsigned RA4:1; unsigned RA5:1; unsigned :2;)
+SIM_SFR(LATA, unsigned LATA0:1; unsigned LATA1:1; unsigned LATA2:1;
+	unsigned LATA3:1; unsigned LATA4:1; unsigned LATA5:1; unsigned :2;)
+SIM_SFR(PORTC, unsigned RC0:1; unsigned RC1:1; unsigned RC2:1; unsigned RC3:1;
+	unsigned RC4:1; unsigned RC5:1; unsigned :2;)
+SIM_SFR(LATC, unsigned LATC0:1; unsigned LATC1:1; unsigned LATC2:1;
+	unsigned LATC3:1; unsigned LATC4:1; unsigned LATC5:1; unsigned :2;)
+SIM_SFR(INTCON, unsigned IOCIF:1; unsigned INTF:1; unsigned T0IF:1;
+	unsigned IOCIE:1; unsigned INTE:1; unsigned T0IE:1; unsigned PEIE:1;
+	unsigned GIE:1;)
+SIM_SFR(PIR1, unsigned TMR1IF:1; unsigned TMR2IF:1; unsigned CCP1IF:1;
+	unsigned SSP1IF:1; unsigned TXIF:1; unsigned RCIF:1; unsigned ADIF:1;
+	unsigned TMR1GIF:1;)
+SIM_SFR(PIE1, unsigned TMR1IE:1; unsigned TMR2IE:1; unsigned CCP1IE:1;
+	unsigned SSP1IE:1; unsigned TXIE:1; unsigned RCIE:1; unsigned ADIE:1;
+	unsigned TMR1GIE:1;)
+SIM_SFR(TXSTA, unsigned TX9D:1; unsigned TRMT:1; unsigned BRGH:1;
+	unsigned SENDB:1; unsigned SYNC:1; unsigned TXEN:1; unsigned TX9:1;
+	unsigned CSRC:1;)
+SIM_SFR(RCSTA, unsigned RX9D:1; unsigned OERR:1; unsigned FERR:1;
+	unsigned ADDEN:1; unsigned CREN:1; unsigned SREN:1; unsigned RX9:1;
+	unsigned SPEN:1;)
+SIM_SFR(BAUDCON, unsigned ABDEN:1; unsigned WUE:1; unsigned :1;
+	unsigned BRG16:1; unsigned SCKP:1; unsigned :1; unsigned RCIDL:1;
+	unsigned ABDOVF:1;)
+SIM_SFR(SSP1CON1, unsigned SSPM:4; unsigned CKP:1; unsigned SSPEN:1;
+	unsigned SSPOV:1; unsigned WCOL:1;)
+SIM_SFR(SSP1CON2, unsigned SEN:1; unsigned RSEN:1; unsigned PEN:1;
+	unsigned RCEN:1; unsigned ACKEN:1; unsigned ACKDT:1; unsigned ACKSTAT:1;
+	unsigned GCEN:1;)
+SIM_SFR(EECON1, unsigned RD:1; unsigned WR:1; unsigned WREN:1;
+	unsigned WRERR:1; unsigned FREE:1; unsigned LWLO:1; unsigned CFGS:1;
+	unsigned EEPGD:1;)
+
+#define PORTA		sim_PORTA.byte
+#define PORTAbits	sim_PORTA.bits
+#define LATA		sim_LATA.byte
+#define LATAbits	sim_LATA.bits
+#define PORTC		sim_PORTC.byte
+#define PORTCbits	sim_PORTC.bits
+#define LATC		sim_LATC.byte
+#define LATCbits	sim_LATC.bits
+#define INTCON		sim_INTCON.byte
+#define INTCONbits	sim_INTCON.bits
+#define PIR1		sim_PIR1.byte
+#define PIR1bits	sim_PIR1.bits
+#define PIE1		sim_PIE1.byte
+#define PIE1bits	sim_PIE1.bits
+#define TXSTA		sim_TXSTA.byte
+#define TXSTAbits	sim_TXSTA.bits
+#define RCSTA		sim_RCSTA.byte
+#define RCSTAbits	(sim_rcsta()->bits)
+#define BAUDCON		sim_BAUDCON.byte
+#define BAUDCONbits	sim_BAUDCON.bits
+#define SSP1CON1	sim_SSP1CON1.byte
+#define SSP1CON1bits	sim_SSP1CON1.bits
+#define SSP1CON2	sim_SSP1CON2.byte
+#define SSP1CON2bits	sim_SSP1CON2.bits
+#define SSPCON2bits	sim_SSP1CON2.bits
+#define EECON1		sim_EECON1.byte
+#define EECON1bits	sim_EECON1.bits
+
+extern volatile uint8_t OSCCON, APFCON0, APFCON1, ANSELA, ANSELC, TRISA, TRISC,
+WPUA, WPUC, SPBRGL, SPBRGH, SSP1CON3, SSPADD, SSPSTAT, OPTION_REG, T1CON;
+extern volatile uint16_t TXREG, SSP1BUF;
+
+#define RCREG	sim_uart_getc()
+#define TMR1L	sim_tmr1(0)
+#define TMR1H	sim_tmr1(1)
+
+/*
+* Simulator interface
+*/
+
+#define SIM_FOSC	32000000UL		// Oscillator frequency
+#define SIM_MIPS	(SIM_FOSC / 4)		// Instruction cycles per second
+
+// Interrupt sources, in the order isr() serves them
+enum {SIM_RDA = 0, SIM_TMR0, SIM_I2C, SIM_INT, SIM_TBE, SIM_SOURCES};
+
+typedef struct {
+	uint64_t cycles;			// Simulated instruction cycles
+	uint64_t fgpasses;			// Foreground CLRWDT()'s
+	uint64_t isrcalls;			// Interrupt entries
+	uint64_t isrcycles;			// Modeled cycles spent in isr()
+	uint64_t fgns;				// Host ns spent in foreground code
+	uint64_t isrns;				// Host ns spent in isr()
+	uint64_t rxbytes;			// Bytes delivered to the UART
+	uint64_t txbytes;			// Bytes sent by the UART
+	uint64_t i2ctrans;			// I2C transactions (STOP's)
+	uint64_t eewrites;			// EEPROM byte writes
+	uint64_t idlecycles;			// Cycles spent in SLEEP()
+	uint64_t sleeps;			// SLEEP() calls
+	uint64_t rxlatmax;			// Most cycles a byte waited in the RX FIFO
+	uint64_t overruns;			// Bytes lost to a full RX FIFO
+	uint64_t framing;			// Bytes received with a framing error
+} sim_stats_t;
+
+typedef struct {
+	double volts;				// Bus voltage
+	double amps;				// Shunt current
+	double rshunt;				// Shunt resistance in ohms
+	uint16_t regs[8];			// Register file
+} sim_ina226_t;
+
+extern sim_stats_t sim_stats;
+extern sim_ina226_t sim_ina226;
+extern uint32_t sim_fgcycles;			// Modeled cycles per foreground pass
+extern uint32_t sim_isrcycles;			// Modeled cycles per isr() entry
+extern uint32_t sim_srccycles[SIM_SOURCES];	// Modeled cycles per handler run
+extern uint64_t sim_rxlast;			// Cycle the last queued RX byte arrived
+extern uint64_t sim_txfirst;			// Cycle a TX byte started, if 0
+extern void (*sim_txhook)(uint8_t c);		// Called for every byte sent
+extern unsigned sim_hostbittime;		// Host UART cycles per bit, 0 follows the node
+
+void isr(void);
+void sim_step(void);
+void sim_sleep(void);
+void sim_stall(uint64_t cycles);
+uint8_t sim_uart_getc(void);
+volatile RCSTA_t *sim_rcsta(void);
+uint8_t sim_tmr1(int high);
+void sim_init(void);
+void sim_run(uint64_t cycles);
+void sim_uart_send(const uint8_t *buf, unsigned len);
+unsigned sim_uart_recv(uint8_t *buf, unsigned max);
+unsigned sim_uart_bittime(void);
+
+#endif